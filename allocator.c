@@ -1,22 +1,128 @@
+#define _GNU_SOURCE
+
 #include "allocator.h"
 
+#include <assert.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 /*
  * @typedef ALIGN
  * @brief Allignment type for ensuring proper memory allignment.
  */
-typedef char ALIGN[sizeof(max_align_t)];
+typedef char ALIGN[_Alignof(max_align_t)];
+
+/*
+ * Size of the regions mapped from the OS. Blocks are carved out of a chunk
+ * until it is exhausted; requests above the mmap threshold, at most
+ * CHUNK_BLOCK_MAX, get a chunk of their own. Chunks are aligned to
+ * CHUNK_SIZE, so the chunk of a block is found by masking its header address.
+ */
+#define CHUNK_SIZE (4UL << 20)
+#define CHUNK_BLOCK_MAX (CHUNK_SIZE / 2)
+
+/*
+ * Kinds of chunk: CHUNK_BLOCKS chunks hold headered blocks, a CHUNK_LARGE
+ * chunk holds a single large block, CHUNK_SLABS chunks are split into slabs
+ * of small headerless objects, see slab_t, CHUNK_ARENA chunks belong to an
+ * arena_t and CHUNK_POOL chunks hold the objects of a pool_t.
+ */
+#define CHUNK_BLOCKS 0u
+#define CHUNK_LARGE 1u
+#define CHUNK_SLABS 2u
+#define CHUNK_ARENA 3u
+#define CHUNK_POOL 4u
+
+/*
+ * Size of a huge page. A chunk is made of whole huge pages, which back it
+ * according to M_HUGEPAGES_A: CHUNK_HUGETLB marks a chunk mapped with
+ * MAP_HUGETLB, CHUNK_THP a chunk advised with MADV_HUGEPAGE.
+ */
+#define HUGE_PAGE_SIZE (2UL << 20)
+#define CHUNK_HUGETLB 1u
+#define CHUNK_THP 2u
+
+_Static_assert(CHUNK_SIZE % HUGE_PAGE_SIZE == 0,
+               "chunks must be made of whole huge pages");
+
+/*
+ * NUMA nodes supported, and the node of a chunk left to first-touch
+ * placement. Chunks are bound to their node with mbind(MPOL_PREFERRED)
+ * through the raw system call, so libnuma is not needed.
+ */
+#define MAX_NUMA_NODES 64u
+#define ANY_NODE ((unsigned)-1)
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+/*
+ * @union chunk_t
+ * @brief Header of a region mapped from the OS.
+ *
+ * In a CHUNK_BLOCKS chunk, blocks are laid out back to back after the chunk
+ * header, so the block following a header is physically adjacent to it. The
+ * space between top and the end of the chunk has not been carved yet.
+ *
+ * Structure:
+ *
+ *    +---------+----------+-------+----------+-------+-----------------+
+ *    | chunk_t | header_t | block | header_t | block | uncarved        |
+ *    +---------+----------+-------+----------+-------+-----------------+
+ *
+ *    ^                                                ^                 ^
+ *    |                                                |                 |
+ *    start                                            top               end
+ */
+typedef union chunk {
+  struct {
+    /* Pointers to the neighbouring chunks in the chunk list */
+    union chunk *next;
+    union chunk *prev;
+
+    /* Size of the mapping in bytes including the chunk header */
+    size_t size;
+
+    /* End of the last carved block */
+    char *top;
+
+    /* CHUNK_* kind, fixed for the lifetime of the chunk */
+    unsigned kind;
+
+    /* Slabs of a CHUNK_SLABS chunk that are not empty */
+    unsigned slabs_used;
+
+    /* CHUNK_HUGETLB or CHUNK_THP if huge pages back the chunk, else 0 */
+    unsigned huge;
+
+    /* NUMA node the chunk is bound to, or ANY_NODE */
+    unsigned node;
+  } s;
+
+  /* Pads the header to a multiple of the alignment */
+  ALIGN stub[3];
+} chunk_t;
 
 /*
  * @union header_t
  * @brief memory block metadata header with allignment.
  *
- * Each block of memory is preceeded by this header, which tracks size,
- * allocation status, and links to succeeding blocks.
+ * Each block larger than SMALL_SIZE_MAX is preceeded by this header. Block
+ * sizes are multiples of _Alignof(max_align_t), so the low bits of the size
+ * hold the BLOCK_* flags. Free list links are only kept inside free blocks,
+ * see free_links_t, and small objects have no header at all.
  *
  * Structure:
  *
@@ -30,231 +136,4652 @@ typedef char ALIGN[sizeof(max_align_t)];
  */
 typedef union header {
   struct {
-    /* Size of the allocated memory block in bytes excluding the header */
+    /* Size of the memory block in bytes excluding the header, or'ed with
+     * the BLOCK_* flags */
     size_t size;
-
-    /* Free status flag */
-    unsigned is_free;
-
-    /* Pointer to the next block in the free list */
-    union header *next;
-
-    /* Pointer to the next block in the allocation tracking list */
-    union header *next_alloc;
   } s;
   ALIGN stub;
 } header_t;
 
+_Static_assert(sizeof(chunk_t) % _Alignof(max_align_t) == 0,
+               "chunk_t must preserve block alignment");
+_Static_assert(sizeof(header_t) % _Alignof(max_align_t) == 0,
+               "header_t must preserve block alignment");
+
+/*
+ * BLOCK_FREE is set on a block in the shared pool's free lists. BLOCK_IDLE is
+ * set on a free block by an automatic trim pass, and a block still free at
+ * the next pass has its whole pages given back with madvise and
+ * BLOCK_RELEASED set. BLOCK_PREV_FREE is set on a block, free or not, whose
+ * physical predecessor in the chunk is on the free lists.
+ */
+#define BLOCK_FREE 1u
+#define BLOCK_IDLE 2u
+#define BLOCK_RELEASED 4u
+#define BLOCK_PREV_FREE 8u
+#define BLOCK_FLAGS (_Alignof(max_align_t) - 1)
+
+_Static_assert(BLOCK_PREV_FREE <= BLOCK_FLAGS,
+               "block flags must fit in the alignment bits of the size");
+
+/*
+ * @brief Returns the size of a block in bytes, without its flags. The owner
+ * of an allocated block reads it without global_malloc_lock while its
+ * BLOCK_PREV_FREE flag may change under the lock, hence the atomic load.
+ */
+static inline size_t block_size(const header_t *header) {
+  return __atomic_load_n(&header->s.size, __ATOMIC_RELAXED) &
+         ~(size_t)BLOCK_FLAGS;
+}
+
+/*
+ * Largest request served from slabs owned by the per-thread heaps. Requests
+ * up to this size are rounded up to one of the size classes below.
+ */
+#define SMALL_SIZE_MAX 1024
+
 /*
- *  Global mutex for access to allocator data structures
+ * Number of small size classes: 16 byte steps up to 128 bytes, then four
+ * classes per power of two up to SMALL_SIZE_MAX.
  */
-static pthread_mutex_t global_malloc_lock = PTHREAD_MUTEX_INITIALIZER;
+#define NUM_SIZE_CLASSES 20
 
 /*
- * Head of the allocation tracking list for automatic cleanup
+ * Size of a cache line, to keep data written by other threads apart from
+ * data only the owning thread touches
  */
-static header_t *alloc_list_head = NULL;
+#define CACHE_LINE 64
 
 /*
- * Head and tail of the main memory block linked list
+ * Block sizes of the small size classes
  */
-static header_t *head;
-static header_t *tail;
+static const size_t class_sizes[NUM_SIZE_CLASSES] = {
+    16,  32,  48,  64,  80,  96,  112, 128, 160, 192,
+    224, 256, 320, 384, 448, 512, 640, 768, 896, 1024,
+};
 
 /*
- * @brief Searches the free list for a block large enough for the given size
+ * @brief Maps a request size to its small size class
  *
- * @param size Minimum size required in bytes
+ * @param size Request size in bytes, between 1 and SMALL_SIZE_MAX
  *
- * @return Pointer to a suitable free block, or NULL
+ * @return Index into class_sizes
  */
-static header_t *get_free_block(size_t size) {
-  header_t *curr = head;
-  while (curr) {
-    if (curr->s.is_free && curr->s.size >= size)
-      return curr;
-    curr = curr->s.next;
-  }
-  return NULL;
+static inline unsigned size_to_class(size_t size) {
+  unsigned lg;
+
+  if (size <= 128)
+    return (unsigned)((size + 15) >> 4) - 1;
+
+  lg = 63 - __builtin_clzl(size - 1);
+  return 8 + (lg - 7) * 4 + (unsigned)((size - 1) >> (lg - 2)) - 4;
 }
 
-void *malloc_a(size_t size) {
-  size_t total_size;
-  void *block;
-  header_t *header;
+_Static_assert(NUM_SIZE_CLASSES == SIZE_CLASSES_A,
+               "allocator.h must agree on the number of size classes");
 
-  if (!size)
-    return NULL;
+/*
+ * @struct thread_stats_t
+ * @brief Counters kept by each thread. Only the owning thread writes them,
+ * with relaxed atomic stores, and stats_a() sums them up on demand.
+ */
+typedef struct thread_stats {
+  size_t malloc_count;
+  size_t free_count;
 
-  if (size > SIZE_MAX - sizeof(max_align_t) + 1) {
-    return NULL;
-  }
+  /* Block bytes handed to and given back by the program */
+  size_t bytes_allocated;
+  size_t bytes_freed;
 
-  size_t aligned_size =
-      (size + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1);
+  /* Bytes requested for small objects and bytes of the objects handed out */
+  size_t small_requested;
+  size_t small_handed_out;
 
-  if (aligned_size > SIZE_MAX - sizeof(header_t)) {
-    return NULL;
-  }
+  /* Acquisitions of global_malloc_lock, and those that found it held */
+  size_t lock_acquisitions;
+  size_t lock_contentions;
 
-  pthread_mutex_lock(&global_malloc_lock);
-  header = get_free_block(aligned_size);
-  if (header) {
-    header->s.is_free = 0;
-    pthread_mutex_unlock(&global_malloc_lock);
-    return (void *)(header + 1);
-  }
+#ifdef ALLOCATOR_TIMING
+  /* Histograms of the waits for and holds of global_malloc_lock and of the
+   * malloc_a() and free_a() calls, see timing_bucket() */
+  size_t lock_wait_ns[TIMING_BUCKETS_A];
+  size_t lock_hold_ns[TIMING_BUCKETS_A];
+  size_t malloc_ns[TIMING_BUCKETS_A];
+  size_t free_ns[TIMING_BUCKETS_A];
 
-  total_size = sizeof(header_t) + aligned_size;
+  /* The lock holds again, split by the LOCK_OP_*_A operation holding it */
+  size_t lock_hold_op_ns[LOCK_OPS_A][TIMING_BUCKETS_A];
+#endif
+} thread_stats_t;
 
-  block = mmap(NULL, total_size, PROT_READ | PROT_WRITE,
-               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+/*
+ * Counters are skipped by a thread that has no heap, see tcache_register()
+ */
+#define STAT_ADD(field, n)                                                     \
+  do {                                                                         \
+    if (tcache)                                                                \
+      __atomic_store_n(&tcache->stats.field, tcache->stats.field + (n),        \
+                       __ATOMIC_RELAXED);                                      \
+  } while (0)
 
-  if (block == MAP_FAILED) {
-    pthread_mutex_unlock(&global_malloc_lock);
-    return NULL;
-  }
+/*
+ * A thread's magazine for a pool returns half of its objects to the pool
+ * once it holds more than POOL_MAG_MAX, and an empty magazine takes up to
+ * POOL_MAG_BATCH objects from the pool at once.
+ */
+#define POOL_MAG_MAX 64
+#define POOL_MAG_BATCH 32
 
-  header = block;
-  header->s.size = aligned_size;
-  header->s.is_free = 0;
-  header->s.next = NULL;
+/*
+ * @struct magazine_t
+ * @brief Free objects of a pool held by a thread, linked through their first
+ * word
+ */
+typedef struct magazine {
+  struct pool *pool;
+  void *head;
+  unsigned count;
+} magazine_t;
+
+/*
+ * @struct tcache_t
+ * @brief Per-thread heap of small objects.
+ *
+ * A thread takes whole slabs from the shared pool and owns them until they
+ * are empty again, so it allocates from and frees to them without any lock.
+ * Other threads cannot touch an owned slab; they push the objects they free
+ * onto the owner's remote list with a single CAS, and the owner takes the
+ * whole list at once and returns the objects to their slabs.
+ *
+ * A heap outlives its thread: it may still receive remote frees, so at
+ * thread exit it is abandoned with the slabs still in use and a new thread
+ * adopts it later. Heaps are never unmapped.
+ */
+typedef struct tcache {
+  /* Objects freed by other threads, on a cache line of its own */
+  void *remote;
+  char pad[CACHE_LINE - sizeof(void *)];
 
-  if (!head)
-    head = header;
-  if (tail)
-    tail->s.next = header;
-  tail = header;
+  /* Owned slabs of each size class with objects left, the one in use first */
+  struct slab *slabs[NUM_SIZE_CLASSES];
 
-  header->s.next_alloc = alloc_list_head;
-  alloc_list_head = header;
+  /* Free objects in the owned slabs of each size class */
+  size_t counts[NUM_SIZE_CLASSES];
 
-  pthread_mutex_unlock(&global_malloc_lock);
+  /* Magazines of free pool objects indexed by pool id, see pool_t. The array
+   * is mapped apart from the heap and only replaced under
+   * global_malloc_lock. */
+  magazine_t *mags;
+  unsigned mag_count;
 
-  return (void *)(header + 1);
+  thread_stats_t stats;
+
+  /* NUMA node the heap's slabs are taken from */
+  unsigned node;
+
+  /* Links in the list of registered or abandoned heaps */
+  struct tcache *next;
+  struct tcache *prev;
+} tcache_t;
+
+/*
+ * Heap of the calling thread, NULL until its first allocation or free. The
+ * initial-exec model keeps TLS accesses from calling into the dynamic
+ * loader, which may allocate, when the allocator is a preloaded library.
+ */
+static __thread tcache_t *tcache __attribute__((tls_model("initial-exec")));
+
+/*
+ * Registration state of the calling thread's heap. A thread takes no heap
+ * while it is registering one, should pthread allocate in the meantime, nor
+ * once its heap was abandoned at thread exit; allocations are then served
+ * from the shared pool.
+ */
+#define TCACHE_NONE 0u
+#define TCACHE_REGISTERING 1u
+#define TCACHE_REGISTERED 2u
+#define TCACHE_EXITED 3u
+
+static __thread unsigned tcache_state
+    __attribute__((tls_model("initial-exec")));
+
+/*
+ * Key whose destructor abandons a thread's heap when the thread exits
+ */
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+/*
+ * @struct alloc_lock_t
+ * @brief Lock of the shared structures, which are held for short stretches.
+ *
+ * A thread that finds the lock held spins for a while before it parks in the
+ * kernel on a futex, so a refill that only waits for another short critical
+ * section never sleeps. Like glibc's adaptive mutexes, the number of spins
+ * adapts to how many it took to get the lock before. state is 0 when free, 1
+ * when held, and 2 when held with threads possibly parked, so that releasing
+ * an uncontended lock makes no system call.
+ */
+typedef struct alloc_lock {
+  int state;
+  int spins;
+} alloc_lock_t;
+
+#define ALLOC_LOCK_INIT {0, 0}
+#define LOCK_SPIN_MAX 128
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
 }
 
-void free_a(void *block) {
-  header_t *header, *tmp, *prev = NULL;
+static inline void lock_init(alloc_lock_t *lock) {
+  lock->state = 0;
+  lock->spins = 0;
+}
 
-  if (!block)
-    return;
+/*
+ * @return 1 if the lock was taken, 0 if it is held
+ */
+static inline int lock_try(alloc_lock_t *lock) {
+  int expected = 0;
 
-  pthread_mutex_lock(&global_malloc_lock);
-  header = (header_t *)block - 1;
+  return __atomic_compare_exchange_n(&lock->state, &expected, 1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
 
-  tmp = alloc_list_head;
-  while (tmp) {
-    if (tmp == header) {
-      if (prev) {
-        prev->s.next_alloc = tmp->s.next_alloc;
-      } else {
-        alloc_list_head = tmp->s.next_alloc;
-      }
+/*
+ * @brief Takes a lock found held: spins up to twice the recent average, then
+ * parks until the holder releases it
+ */
+static void lock_wait(alloc_lock_t *lock) {
+  int spins = __atomic_load_n(&lock->spins, __ATOMIC_RELAXED);
+  int max = spins * 2 + 10 < LOCK_SPIN_MAX ? spins * 2 + 10 : LOCK_SPIN_MAX;
+  int n;
+
+  for (n = 0; n < max; n++) {
+    cpu_relax();
+    if (!__atomic_load_n(&lock->state, __ATOMIC_RELAXED) && lock_try(lock))
       break;
-    }
-    prev = tmp;
-    tmp = tmp->s.next_alloc;
   }
+  __atomic_store_n(&lock->spins, spins + (n - spins) / 8, __ATOMIC_RELAXED);
+  if (n < max)
+    return;
 
-  header->s.is_free = 1;
-
-  tmp = header->s.next;
-  while (tmp && tmp->s.is_free) {
-    header_t *next_block = tmp->s.next;
-    header->s.size += sizeof(header_t) + tmp->s.size;
-    header->s.next = next_block;
+  while (__atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE))
+    syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+}
 
-    if (tmp == tail) {
-      tail = header;
-    }
-    tmp = next_block;
-  }
+static inline void lock_acquire(alloc_lock_t *lock) {
+  if (!lock_try(lock))
+    lock_wait(lock);
+}
 
-  pthread_mutex_unlock(&global_malloc_lock);
+static inline void lock_release(alloc_lock_t *lock) {
+  if (__atomic_exchange_n(&lock->state, 0, __ATOMIC_RELEASE) == 2)
+    syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
 }
 
 /*
- * @brief: Frees all remaining allocated memory blocks at program exit
+ *  Global lock for access to allocator data structures
  */
-static void cleanup_a(void) {
-  pthread_mutex_lock(&global_malloc_lock);
+static alloc_lock_t global_malloc_lock = ALLOC_LOCK_INIT;
 
-  header_t *curr = alloc_list_head;
+/*
+ * Building with -DALLOCATOR_TIMING times every wait for and hold of
+ * global_malloc_lock and every malloc_a() and free_a() call into per-thread
+ * histograms reported by stats_a(). Without it no clock is read.
+ */
+#ifdef ALLOCATOR_TIMING
+/* When the holder of global_malloc_lock took it */
+static uint64_t lock_taken_ns;
 
-  while (curr) {
-    header_t *next = curr->s.next_alloc;
-    if (!curr->s.is_free) {
-      pthread_mutex_unlock(&global_malloc_lock);
-      free_a((void *)(curr + 1));
-      pthread_mutex_lock(&global_malloc_lock);
-    }
-    curr = next;
-  }
+/* LOCK_OP_*_A operation the thread is in, the default LOCK_OP_OTHER_A
+ * outside malloc_a(), free_a() and the exit handler */
+static __thread unsigned timing_op __attribute__((tls_model("initial-exec")));
 
-  pthread_mutex_unlock(&global_malloc_lock);
+static inline uint64_t timing_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
 }
 
 /*
- * Manual declaration of the standard library atexit() function to avoid
- * including <stdlib.h>. The extern "C" guards ensure proper C linkage
- * when this header is included from C++ source files.
+ * @brief Returns the histogram bucket of a duration: bucket i counts
+ * durations from 2^i up to 2^(i+1) nanoseconds, the last one all longer ones
  */
-#ifdef __cplusplus
-extern "C" {
+static inline unsigned timing_bucket(uint64_t ns) {
+  unsigned bucket = 63 - (unsigned)__builtin_clzll(ns | 1);
+  return bucket < TIMING_BUCKETS_A ? bucket : TIMING_BUCKETS_A - 1;
+}
+
+#define TIMING_RECORD(hist, ns)                                                \
+  do {                                                                         \
+    unsigned bucket_ = timing_bucket(ns);                                      \
+    STAT_ADD(hist[bucket_], 1);                                                \
+  } while (0)
 #endif
 
-extern int atexit(void (*func)(void));
+/*
+ * NUMA nodes of the machine, found at program start; with a single node
+ * nothing is bound. Node heaps serve malloc_node_a() requests for a node
+ * other than the caller's, each under its lock, which is taken before
+ * global_malloc_lock.
+ */
+static unsigned numa_nodes = 1;
+static tcache_t *node_heaps[MAX_NUMA_NODES];
+static alloc_lock_t node_heap_locks[MAX_NUMA_NODES];
 
-#ifdef __cplusplus
+/*
+ * Registered heaps, heaps of exited threads waiting to be adopted, and the
+ * summed counters of exited threads
+ */
+static tcache_t *tcache_list;
+static tcache_t *abandoned_heaps;
+static thread_stats_t retired_stats;
+
+/*
+ * Mapping new heaps are carved from
+ */
+#define HEAP_POOL_SIZE (64UL << 10)
+static char *heap_pool;
+static size_t heap_pool_left;
+
+/*
+ * System call counters, updated atomically since some calls happen outside
+ * global_malloc_lock
+ */
+static size_t stat_mmaps;
+static size_t stat_munmaps;
+static size_t stat_mremaps;
+static size_t stat_madvises;
+
+#define SYSCALL_STAT(counter)                                                  \
+  __atomic_fetch_add(&(counter), 1, __ATOMIC_RELAXED)
+
+/*
+ * @brief Acquires global_malloc_lock, counting acquisitions that find it
+ * held by another thread
+ */
+static inline void malloc_lock(void) {
+#ifdef ALLOCATOR_TIMING
+  uint64_t start = 0;
+#endif
+
+  STAT_ADD(lock_acquisitions, 1);
+  if (!lock_try(&global_malloc_lock)) {
+    STAT_ADD(lock_contentions, 1);
+#ifdef ALLOCATOR_TIMING
+    start = timing_now();
+#endif
+    lock_wait(&global_malloc_lock);
+  }
+
+#ifdef ALLOCATOR_TIMING
+  /* An acquisition that did not wait counts as a wait of 0 */
+  lock_taken_ns = timing_now();
+  TIMING_RECORD(lock_wait_ns, start ? lock_taken_ns - start : 0);
+#endif
+}
+
+static inline void malloc_unlock(void) {
+#ifdef ALLOCATOR_TIMING
+  uint64_t held = timing_now() - lock_taken_ns;
+#endif
+
+  lock_release(&global_malloc_lock);
+#ifdef ALLOCATOR_TIMING
+  TIMING_RECORD(lock_hold_ns, held);
+  TIMING_RECORD(lock_hold_op_ns[timing_op], held);
+#endif
 }
+
+/*
+ * @brief Adds the counters of a thread, possibly still running, to a sum
+ */
+static void add_thread_stats(thread_stats_t *sum, const thread_stats_t *ts) {
+  sum->malloc_count += __atomic_load_n(&ts->malloc_count, __ATOMIC_RELAXED);
+  sum->free_count += __atomic_load_n(&ts->free_count, __ATOMIC_RELAXED);
+  sum->bytes_allocated +=
+      __atomic_load_n(&ts->bytes_allocated, __ATOMIC_RELAXED);
+  sum->bytes_freed += __atomic_load_n(&ts->bytes_freed, __ATOMIC_RELAXED);
+  sum->small_requested +=
+      __atomic_load_n(&ts->small_requested, __ATOMIC_RELAXED);
+  sum->small_handed_out +=
+      __atomic_load_n(&ts->small_handed_out, __ATOMIC_RELAXED);
+  sum->lock_acquisitions +=
+      __atomic_load_n(&ts->lock_acquisitions, __ATOMIC_RELAXED);
+  sum->lock_contentions +=
+      __atomic_load_n(&ts->lock_contentions, __ATOMIC_RELAXED);
+#ifdef ALLOCATOR_TIMING
+  for (unsigned i = 0; i < TIMING_BUCKETS_A; i++) {
+    sum->lock_wait_ns[i] +=
+        __atomic_load_n(&ts->lock_wait_ns[i], __ATOMIC_RELAXED);
+    sum->lock_hold_ns[i] +=
+        __atomic_load_n(&ts->lock_hold_ns[i], __ATOMIC_RELAXED);
+    sum->malloc_ns[i] += __atomic_load_n(&ts->malloc_ns[i], __ATOMIC_RELAXED);
+    sum->free_ns[i] += __atomic_load_n(&ts->free_ns[i], __ATOMIC_RELAXED);
+    for (unsigned op = 0; op < LOCK_OPS_A; op++)
+      sum->lock_hold_op_ns[op][i] +=
+          __atomic_load_n(&ts->lock_hold_op_ns[op][i], __ATOMIC_RELAXED);
+  }
 #endif
+}
 
 /*
- * @brief Initializer function that registers cleanup at program start
+ * List of all mapped chunks
  */
-__attribute__((constructor)) void init_a(void) { atexit(cleanup_a); }
+static chunk_t *chunk_list;
 
-void *calloc_a(size_t num, size_t nsize) {
-  size_t size;
-  void *block;
+/*
+ * Mappings of freed large blocks, kept for the next large requests instead of
+ * being unmapped. Cached chunks are off chunk_list but still count as mapped;
+ * together they hold at most LARGE_CACHE_MAX bytes, and trim passes unmap
+ * them.
+ */
+#define LARGE_CACHE_SLOTS 8
+#define LARGE_CACHE_MAX (64UL << 20)
 
-  if (!num || !nsize)
-    return NULL;
+static chunk_t *large_cache[LARGE_CACHE_SLOTS];
+static size_t large_cache_bytes;
 
-  size = num * nsize;
-  if (nsize != size / num)
-    return NULL;
+/*
+ * Release policy, see mallopt_a(). Free bytes accumulate in pending_release
+ * until an automatic trim gives their pages back to the OS.
+ */
+static size_t trim_threshold = 64UL << 20;
+static size_t trim_delay_ms = 1000;
+static int unmap_empty_chunks = 1;
 
-  block = malloc_a(size);
-  if (!block)
-    return NULL;
+/*
+ * What cleanup_a() does at program exit, one of the EXIT_*_A values
+ */
+static int exit_cleanup = EXIT_CLEANUP_OFF_A;
+static size_t pending_release;
+static struct timespec last_trim;
 
-  memset(block, 0, size);
+/*
+ * Requests above this size bypass the chunks and are mapped directly
+ */
+static size_t mmap_threshold = 1UL << 20;
 
-  return block;
+/*
+ * Smallest remainder, excluding its header, worth splitting off a reused free
+ * block. Never below sizeof(free_links_t), which a free block must hold.
+ */
+static size_t split_min = 64;
+
+/*
+ * Bytes the shared pool was asked for and bytes of the blocks it handed out,
+ * since program start
+ */
+static size_t stat_requested;
+static size_t stat_handed_out;
+
+/*
+ * Bytes currently mapped from the OS, and bytes of the blocks on the free
+ * lists and of the empty slabs
+ */
+static size_t stat_mapped;
+static size_t stat_free;
+
+/*
+ * Huge page policy, one of the HUGEPAGES_*_A values, with the chunks
+ * currently mapped under it and the MAP_HUGETLB mappings that failed
+ */
+static int huge_pages = HUGEPAGES_OFF_A;
+static size_t stat_hugetlb_chunks;
+static size_t stat_thp_chunks;
+static size_t stat_hugetlb_fallbacks;
+
+/*
+ * Placement policy of get_free_block, one of the PLACEMENT_*_A values
+ */
+static int placement = PLACEMENT_FIRST_FIT_A;
+
+/*
+ * Number of bins of a block pool's segregated free lists: one per small
+ * size class, then four per power of two above SMALL_SIZE_MAX.
+ */
+#define NUM_FREE_BINS (NUM_SIZE_CLASSES + (64 - 10) * 4)
+
+/*
+ * @struct free_links_t
+ * @brief Free list links, stored in the memory of a free block.
+ */
+typedef struct free_links {
+  header_t *next;
+  header_t *prev;
+} free_links_t;
+
+#define FREE_LINKS(header) ((free_links_t *)((header) + 1))
+
+/*
+ * @struct release_links_t
+ * @brief Links of a free block on its pool's release list, stored right after
+ * its free list links. Only blocks of at least a page, whose pages have not
+ * been released since they were freed, are on the list, so trim passes skip
+ * the blocks that have nothing left to give back.
+ */
+typedef struct release_links {
+  header_t *next;
+  header_t *prev;
+} release_links_t;
+
+#define RELEASE_LINKS(header) ((release_links_t *)(FREE_LINKS(header) + 1))
+
+/*
+ * Boundary tag in the last word of a free block, holding the block's size so
+ * that the block physically following it finds its header in O(1). It never
+ * overlaps the free list links, as free blocks are at least FREE_BLOCK_MIN
+ * bytes large.
+ */
+#define FREE_FOOTER(header)                                                    \
+  ((size_t *)((char *)((header) + 1) + block_size(header)) - 1)
+#define FREE_BLOCK_MIN                                                         \
+  ((sizeof(free_links_t) + sizeof(size_t) + BLOCK_FLAGS) & ~(size_t)BLOCK_FLAGS)
+
+/*
+ * @brief Returns the chunk holding an object or block header
+ */
+static inline chunk_t *chunk_of(const void *ptr) {
+  return (chunk_t *)((uintptr_t)ptr & ~(CHUNK_SIZE - 1));
 }
 
-void *realloc_a(void *block, size_t size) {
-  header_t *header;
-  void *ret;
+/*
+ * @brief Returns the chunk of a block or object handed out. No block starts
+ * its chunk, which holds the chunk_t, but a block aligned to CHUNK_SIZE ends
+ * the first chunk of its mapping, so the chunk is found from the byte before.
+ */
+static inline chunk_t *block_chunk(const void *block) {
+  return chunk_of((const char *)block - 1);
+}
 
-  if (!block)
-    return malloc_a(size);
-  if (!size) {
-    free_a(block);
+/*
+ * @brief Returns the block physically following a block in its chunk
+ *
+ * @return Header of the next block, or NULL if the block is the last one
+ */
+static inline header_t *next_block(header_t *header) {
+  header_t *next = (header_t *)((char *)(header + 1) + block_size(header));
+  return (char *)next < chunk_of(header)->s.top ? next : NULL;
+}
+
+/*
+ * @brief Sets or clears BLOCK_PREV_FREE on a block, see block_size(). Caller
+ * must hold global_malloc_lock.
+ */
+static inline void set_prev_free(header_t *header, int prev_free) {
+  size_t size = header->s.size;
+
+  size = prev_free ? size | BLOCK_PREV_FREE : size & ~(size_t)BLOCK_PREV_FREE;
+  __atomic_store_n(&header->s.size, size, __ATOMIC_RELAXED);
+}
+
+/*
+ * @brief Returns the free block physically preceding a block in its chunk
+ *
+ * @return Header of the previous block, or NULL if that block is allocated or
+ * the block is the first one
+ */
+static inline header_t *prev_free_block(header_t *header) {
+  if (!(header->s.size & BLOCK_PREV_FREE))
     return NULL;
-  }
+  return (header_t *)((char *)header - ((size_t *)header)[-1]) - 1;
+}
 
-  header = (header_t *)block - 1;
-  if (header->s.size >= size)
-    return block;
 
-  ret = malloc_a(size);
-  if (ret) {
-    memcpy(ret, block, header->s.size);
-    free_a(block);
-  }
+/*
+ * @struct block_pool_t
+ * @brief Blocks of the CHUNK_BLOCKS chunks bound to one NUMA node, or of those
+ * bound to none: segregated free lists, a bitmap of their non-empty bins, and
+ * the chunk new blocks are carved from. A free block goes back to the pool of
+ * its chunk, so blocks reused by malloc_node_a() stay on their node.
+ */
+typedef struct block_pool {
+  header_t *bins[NUM_FREE_BINS];
+  uint64_t bin_map[(NUM_FREE_BINS + 63) / 64];
+  size_t bin_counts[NUM_FREE_BINS];
+  chunk_t *current;
 
-  return ret;
+  /* Free blocks with pages to release, see release_links_t */
+  header_t *releasable;
+} block_pool_t;
+
+/*
+ * Pool of the chunks bound to no node first, serving malloc_a(), then the pool
+ * of each NUMA node
+ */
+static block_pool_t block_pools[1 + MAX_NUMA_NODES];
+
+#define SHARED_BLOCKS (&block_pools[0])
+
+/*
+ * @brief Returns the pool of a node, or the shared one for ANY_NODE
+ */
+static inline block_pool_t *node_blocks(unsigned node) {
+  /* ANY_NODE wraps around to the shared pool */
+  return &block_pools[node + 1];
+}
+
+/*
+ * @brief Returns the pool a block of a CHUNK_BLOCKS chunk belongs to
+ */
+static inline block_pool_t *blocks_of(const header_t *header) {
+  return node_blocks(chunk_of(header)->s.node);
+}
+
+/*
+ * @brief Returns the node of a pool's chunks, or ANY_NODE
+ */
+static inline unsigned blocks_node(const block_pool_t *blocks) {
+  return (unsigned)(blocks - block_pools) - 1;
+}
+
+/*
+ * @brief Maps a free block size to the bin holding it. Every block in a bin
+ * is at least as large as the bin's lower bound.
+ *
+ * @param size Block size in bytes excluding the header
+ *
+ * @return Index into the bins of a block pool
+ */
+static inline unsigned size_to_bin(size_t size) {
+  unsigned cls;
+
+  if (size > SMALL_SIZE_MAX) {
+    unsigned lg = 63 - __builtin_clzl(size);
+    return NUM_SIZE_CLASSES + (lg - 10) * 4 +
+           (unsigned)((size >> (lg - 2)) & 3);
+  }
+
+  cls = size_to_class(size);
+  return class_sizes[cls] > size ? cls - 1 : cls;
+}
+
+/*
+ * @brief Returns the system page size
+ */
+static inline size_t page_size(void) {
+  static size_t page;
+
+  if (!page)
+    page = (size_t)sysconf(_SC_PAGESIZE);
+  return page;
+}
+
+/*
+ * @brief Returns whether a free block belongs on its pool's release list
+ */
+static inline int is_releasable(const header_t *header) {
+  return !(header->s.size & BLOCK_RELEASED) &&
+         block_size(header) >= page_size();
+}
+
+/*
+ * @brief Takes a free block off its pool's release list. Caller must hold
+ * global_malloc_lock.
+ */
+static void release_list_remove(block_pool_t *blocks, header_t *header) {
+  release_links_t *links = RELEASE_LINKS(header);
+
+  if (links->prev)
+    RELEASE_LINKS(links->prev)->next = links->next;
+  else
+    blocks->releasable = links->next;
+  if (links->next)
+    RELEASE_LINKS(links->next)->prev = links->prev;
+}
+
+/*
+ * @brief Pushes a free block onto its bin and writes its boundary tag, and
+ * onto its pool's release list if it has pages to release. Caller must hold
+ * global_malloc_lock.
+ */
+static void bin_insert(header_t *header) {
+  block_pool_t *blocks = blocks_of(header);
+  unsigned bin = size_to_bin(block_size(header));
+  free_links_t *links = FREE_LINKS(header);
+  header_t *next = next_block(header);
+
+  *FREE_FOOTER(header) = block_size(header);
+  if (next)
+    set_prev_free(next, 1);
+
+  links->prev = NULL;
+  links->next = blocks->bins[bin];
+  if (links->next)
+    FREE_LINKS(links->next)->prev = header;
+  blocks->bins[bin] = header;
+  blocks->bin_map[bin / 64] |= 1ULL << (bin % 64);
+  blocks->bin_counts[bin]++;
+  stat_free += block_size(header);
+
+  if (is_releasable(header)) {
+    release_links_t *release = RELEASE_LINKS(header);
+
+    release->prev = NULL;
+    release->next = blocks->releasable;
+    if (release->next)
+      RELEASE_LINKS(release->next)->prev = header;
+    blocks->releasable = header;
+  }
+}
+
+/*
+ * @brief Unlinks a free block from its bin and release list. Caller must hold
+ * global_malloc_lock.
+ */
+static void bin_remove(header_t *header) {
+  block_pool_t *blocks = blocks_of(header);
+  unsigned bin = size_to_bin(block_size(header));
+  free_links_t *links = FREE_LINKS(header);
+  header_t *next = next_block(header);
+
+  if (next)
+    set_prev_free(next, 0);
+
+  if (links->prev)
+    FREE_LINKS(links->prev)->next = links->next;
+  else
+    blocks->bins[bin] = links->next;
+  if (links->next)
+    FREE_LINKS(links->next)->prev = links->prev;
+  if (!blocks->bins[bin])
+    blocks->bin_map[bin / 64] &= ~(1ULL << (bin % 64));
+  blocks->bin_counts[bin]--;
+  stat_free -= block_size(header);
+
+  if (is_releasable(header))
+    release_list_remove(blocks, header);
+}
+
+/*
+ * @brief Finds the first non-empty bin of a pool at or above the given index
+ *
+ * @return Bin index, or -1 if every such bin is empty
+ */
+static inline int next_nonempty_bin(const block_pool_t *blocks,
+                                    unsigned bin) {
+  for (unsigned word = bin / 64; word < sizeof(blocks->bin_map) / 8; word++) {
+    uint64_t mask = blocks->bin_map[word];
+    if (word == bin / 64)
+      mask &= ~0ULL << (bin % 64);
+    if (mask)
+      return (int)(word * 64 + __builtin_ctzll(mask));
+  }
+  return -1;
+}
+
+/*
+ * @brief Returns the NUMA node the calling thread runs on
+ */
+static unsigned current_node(void) {
+  unsigned cpu, node;
+
+  if (numa_nodes > 1 && !syscall(SYS_getcpu, &cpu, &node, NULL) &&
+      node < numa_nodes)
+    return node;
+  return 0;
+}
+
+/*
+ * @brief Makes a NUMA node the preferred node of a region's pages. Only pages
+ * not touched yet are placed by the policy.
+ */
+static void bind_to_node(void *addr, size_t len, unsigned node) {
+  unsigned long mask;
+
+  if (numa_nodes <= 1 || node == ANY_NODE)
+    return;
+
+  mask = 1UL << node;
+  syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask,
+          (unsigned long)MAX_NUMA_NODES + 1, 0UL);
+}
+
+/*
+ * @brief Maps a region aligned to CHUNK_SIZE whose first chunk ends at an
+ * address aligned as requested. The mapping is over-sized by the alignment
+ * and trimmed.
+ *
+ * @param size Size of the mapping in bytes, a multiple of the page size
+ * @param flags Extra mmap flags
+ * @param page Size of the pages of the mapping
+ * @param align Alignment of the end of the first chunk, a power of two of at
+ * least CHUNK_SIZE; CHUNK_SIZE just aligns the region
+ *
+ * @return Start of the region, or NULL if mmap failed
+ */
+static char *map_region(size_t size, int flags, size_t page, size_t align) {
+  size_t map_size = size + align - page;
+  char *map, *start;
+
+  if (map_size < size)
+    return NULL;
+
+  map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+  SYSCALL_STAT(stat_mmaps);
+
+  if (map == MAP_FAILED)
+    return NULL;
+
+  start = (char *)((((uintptr_t)map + CHUNK_SIZE + align - 1) & ~(align - 1)) -
+                   CHUNK_SIZE);
+  if (start > map)
+    munmap(map, (size_t)(start - map));
+  if (start + size < map + map_size)
+    munmap(start + size, (size_t)(map + map_size - start - size));
+
+  return start;
+}
+
+/*
+ * @brief Maps a region of normal pages aligned to CHUNK_SIZE, see map_region()
+ */
+static char *map_aligned(size_t size) {
+  return map_region(size, 0, page_size(), CHUNK_SIZE);
+}
+
+/*
+ * @brief Links a chunk into the chunk list. Caller must hold
+ * global_malloc_lock.
+ */
+static void link_chunk(chunk_t *chunk) {
+  chunk->s.prev = NULL;
+  chunk->s.next = chunk_list;
+  if (chunk_list)
+    chunk_list->s.prev = chunk;
+  chunk_list = chunk;
+}
+
+/*
+ * @brief Unlinks a chunk from the chunk list. Caller must hold
+ * global_malloc_lock.
+ */
+static void unlink_chunk(chunk_t *chunk) {
+  if (chunk->s.prev)
+    chunk->s.prev->s.next = chunk->s.next;
+  else
+    chunk_list = chunk->s.next;
+  if (chunk->s.next)
+    chunk->s.next->s.prev = chunk->s.prev;
+}
+
+/*
+ * @brief Maps a new chunk and links it into the chunk list. Caller must hold
+ * global_malloc_lock.
+ *
+ * @param size Size of the mapping in bytes, a multiple of the page size
+ * @param kind CHUNK_* kind of the chunk
+ * @param node NUMA node to bind the chunk to, or ANY_NODE
+ *
+ * @return Pointer to the new chunk, or NULL if mmap failed
+ */
+static chunk_t *map_chunk(size_t size, unsigned kind, unsigned node) {
+  chunk_t *chunk = NULL;
+  unsigned huge = 0;
+
+  if (huge_pages == HUGEPAGES_HUGETLB_A && !(size % HUGE_PAGE_SIZE)) {
+    chunk = (chunk_t *)map_region(size, MAP_HUGETLB, HUGE_PAGE_SIZE, CHUNK_SIZE);
+    if (chunk) {
+      huge = CHUNK_HUGETLB;
+      stat_hugetlb_chunks++;
+    } else {
+      /* No huge page reserved, fall back to transparent huge pages */
+      stat_hugetlb_fallbacks++;
+    }
+  }
+
+  if (!chunk)
+    chunk = (chunk_t *)map_aligned(size);
+  if (!chunk)
+    return NULL;
+
+  if (!huge && huge_pages != HUGEPAGES_OFF_A) {
+    madvise(chunk, size, MADV_HUGEPAGE);
+    SYSCALL_STAT(stat_madvises);
+    huge = CHUNK_THP;
+    stat_thp_chunks++;
+  }
+
+  bind_to_node(chunk, size, node);
+  chunk->s.node = node;
+  chunk->s.huge = huge;
+  chunk->s.size = size;
+  chunk->s.top = (char *)(chunk + 1);
+  chunk->s.kind = kind;
+  link_chunk(chunk);
+  stat_mapped += size;
+
+  return chunk;
+}
+
+/*
+ * @brief Unlinks a chunk from the chunk list and unmaps it. Caller must hold
+ * global_malloc_lock.
+ */
+static void unmap_chunk(chunk_t *chunk) {
+  unlink_chunk(chunk);
+  stat_mapped -= chunk->s.size;
+  if (chunk->s.huge == CHUNK_HUGETLB)
+    stat_hugetlb_chunks--;
+  else if (chunk->s.huge == CHUNK_THP)
+    stat_thp_chunks--;
+  munmap(chunk, chunk->s.size);
+  SYSCALL_STAT(stat_munmaps);
+}
+
+/*
+ * @brief Carves a new allocated block off the top of a chunk. Caller must
+ * hold global_malloc_lock.
+ */
+static header_t *carve_block(chunk_t *chunk, size_t aligned_size) {
+  header_t *header = (header_t *)chunk->s.top;
+
+  chunk->s.top += sizeof(header_t) + aligned_size;
+  header->s.size = aligned_size;
+
+  return header;
+}
+
+/*
+ * @brief Turns the uncarved tail of a pool's current chunk into a free block,
+ * so a new chunk can take its place. Caller must hold global_malloc_lock.
+ */
+static void retire_current_chunk(block_pool_t *blocks) {
+  chunk_t *chunk = blocks->current;
+  size_t left = (size_t)((char *)chunk + chunk->s.size - chunk->s.top);
+  header_t *header;
+
+  blocks->current = NULL;
+  if (left < sizeof(header_t) + FREE_BLOCK_MIN)
+    return;
+
+  header = (header_t *)chunk->s.top;
+  chunk->s.top += left;
+  header->s.size = (left - sizeof(header_t)) | BLOCK_FREE;
+  bin_insert(header);
+}
+
+/*
+ * @brief Carves a new block of a pool, mapping a new chunk bound to the pool's
+ * node when the current one is exhausted. Caller must hold global_malloc_lock.
+ *
+ * @param blocks Pool to carve from
+ * @param aligned_size Size of the block in bytes excluding the header, at most
+ * CHUNK_BLOCK_MAX
+ *
+ * @return Pointer to the new block's header, or NULL if mmap failed
+ */
+static header_t *map_block(block_pool_t *blocks, size_t aligned_size) {
+  size_t need;
+
+  /* The block must be able to hold a boundary tag once freed */
+  if (aligned_size < FREE_BLOCK_MIN)
+    aligned_size = FREE_BLOCK_MIN;
+  need = sizeof(header_t) + aligned_size;
+
+  stat_requested += aligned_size;
+  stat_handed_out += aligned_size;
+
+  if (blocks->current &&
+      (size_t)((char *)blocks->current + CHUNK_SIZE - blocks->current->s.top) <
+          need)
+    retire_current_chunk(blocks);
+
+  if (!blocks->current) {
+    blocks->current =
+        map_chunk(CHUNK_SIZE, CHUNK_BLOCKS, blocks_node(blocks));
+    if (!blocks->current)
+      return NULL;
+  }
+
+  return carve_block(blocks->current, aligned_size);
+}
+
+/*
+ * Small objects live in slabs, SLAB_SIZE pieces of CHUNK_SLABS chunks. A slab
+ * holds objects of a single size class back to back without any header; the
+ * slab of an object is found from its chunk and its offset in the chunk, and
+ * the slab records the size class.
+ *
+ * Structure of a CHUNK_SLABS chunk:
+ *
+ *    +---------+------------------+---------+---------+-----+---------+
+ *    | chunk_t | slab_t slabs[64] | slab 0  | slab 1  | ... | slab 63 |
+ *    +---------+------------------+---------+---------+-----+---------+
+ *
+ * The per-slab metadata shortens the first slab, which starts at the next
+ * multiple of SMALL_SIZE_MAX like every other slab. The objects of a class
+ * are thus aligned to the largest power of two dividing the class size, and
+ * aligned_alloc_a() serves small requests from a class that is a multiple of
+ * the alignment.
+ */
+#define SLAB_SIZE (64UL << 10)
+#define SLABS_PER_CHUNK (CHUNK_SIZE / SLAB_SIZE)
+
+/*
+ * SLAB_IDLE and SLAB_RELEASED age empty slabs the way BLOCK_IDLE and
+ * BLOCK_RELEASED age free blocks
+ */
+#define SLAB_IDLE 1u
+#define SLAB_RELEASED 2u
+
+/*
+ * Size class of an empty slab
+ */
+#define NO_CLASS ((unsigned)-1)
+
+/*
+ * @struct slab_t
+ * @brief Metadata of a slab, kept at the start of its chunk.
+ */
+typedef struct slab {
+  /* Singly linked list of freed objects, linked through their first word */
+  void *free;
+
+  /* First object, end of the objects carved so far, and end of the slab */
+  char *start;
+  char *bump;
+  char *end;
+
+  /* Links in the owner's list of the slab's size class, or the empty list */
+  struct slab *next;
+  struct slab *prev;
+
+  /* Heap owning the slab, NULL if the slab is empty */
+  tcache_t *owner;
+
+  /* Size class of the objects, or NO_CLASS if the slab is empty */
+  unsigned cls;
+
+  /* Objects handed out and not yet returned, and objects the slab holds */
+  unsigned used;
+  unsigned capacity;
+
+  /* SLAB_* state flags of an empty slab */
+  unsigned flags;
+} slab_t;
+
+_Static_assert((SMALL_SIZE_MAX & (SMALL_SIZE_MAX - 1)) == 0 &&
+                   SLAB_SIZE % SMALL_SIZE_MAX == 0,
+               "slabs must start aligned to the largest size class");
+
+/*
+ * Empty slabs of the shared pool by NUMA node, not owned by any heap. Owned
+ * slabs with objects left are on their owner's lists, full slabs are on no
+ * list.
+ */
+static slab_t *empty_slabs[MAX_NUMA_NODES];
+
+static inline slab_t *chunk_slabs(chunk_t *chunk) {
+  return (slab_t *)(chunk + 1);
+}
+
+/*
+ * @brief Returns the slab holding a small object
+ */
+static inline slab_t *slab_of(const void *ptr) {
+  chunk_t *chunk = chunk_of(ptr);
+  return chunk_slabs(chunk) + ((uintptr_t)ptr - (uintptr_t)chunk) / SLAB_SIZE;
+}
+
+static void slab_push(slab_t **list, slab_t *slab) {
+  slab->prev = NULL;
+  slab->next = *list;
+  if (*list)
+    (*list)->prev = slab;
+  *list = slab;
+}
+
+static void slab_unlink(slab_t **list, slab_t *slab) {
+  if (slab->prev)
+    slab->prev->next = slab->next;
+  else
+    *list = slab->next;
+  if (slab->next)
+    slab->next->prev = slab->prev;
+}
+
+/*
+ * @brief Maps a new CHUNK_SLABS chunk bound to a NUMA node and puts its slabs
+ * on the node's empty list. Caller must hold global_malloc_lock.
+ *
+ * @return 0 on success, -1 if mmap failed
+ */
+static int map_slab_chunk(unsigned node) {
+  chunk_t *chunk = map_chunk(CHUNK_SIZE, CHUNK_SLABS, node);
+  slab_t *slabs;
+  char *first;
+
+  if (!chunk)
+    return -1;
+
+  slabs = chunk_slabs(chunk);
+  first = (char *)(((uintptr_t)(slabs + SLABS_PER_CHUNK) + SMALL_SIZE_MAX - 1) &
+                   ~(uintptr_t)(SMALL_SIZE_MAX - 1));
+  chunk->s.slabs_used = 0;
+  chunk->s.top = (char *)chunk + CHUNK_SIZE;
+
+  /* Pushed in reverse, so the lowest slabs are handed out first */
+  for (unsigned i = SLABS_PER_CHUNK; i-- > 0;) {
+    slab_t *slab = &slabs[i];
+
+    slab->start = i ? (char *)chunk + i * SLAB_SIZE : first;
+    slab->end = (char *)chunk + (i + 1) * SLAB_SIZE;
+    slab->cls = NO_CLASS;
+    slab->owner = NULL;
+    slab->flags = 0;
+    slab_push(&empty_slabs[node], slab);
+    stat_free += (size_t)(slab->end - slab->start);
+  }
+
+  return 0;
+}
+
+/*
+ * @brief Takes the slabs of an unused CHUNK_SLABS chunk off the empty list
+ * and unmaps the chunk. Caller must hold global_malloc_lock.
+ */
+static void unmap_slab_chunk(chunk_t *chunk) {
+  slab_t *slabs = chunk_slabs(chunk);
+
+  for (unsigned i = 0; i < SLABS_PER_CHUNK; i++) {
+    slab_unlink(&empty_slabs[chunk->s.node], &slabs[i]);
+    stat_free -= (size_t)(slabs[i].end - slabs[i].start);
+  }
+  unmap_chunk(chunk);
+}
+
+/*
+ * @brief Hands an empty slab of the heap's NUMA node to a heap for a size
+ * class, mapping a new chunk if the node has no slab empty. Slabs of other
+ * nodes are only used when mmap fails. Caller must hold global_malloc_lock.
+ *
+ * @return The slab, now on the heap's list of the class, or NULL if mmap
+ * failed
+ */
+static slab_t *slab_assign(tcache_t *heap, unsigned cls) {
+  slab_t **list = &empty_slabs[heap->node];
+  slab_t *slab;
+
+  if (!*list && map_slab_chunk(heap->node)) {
+    unsigned node = 0;
+
+    while (node < numa_nodes && !empty_slabs[node])
+      node++;
+    if (node == numa_nodes)
+      return NULL;
+    list = &empty_slabs[node];
+  }
+
+  slab = *list;
+  slab_unlink(list, slab);
+  stat_free -= (size_t)(slab->end - slab->start);
+  chunk_of(slab)->s.slabs_used++;
+
+  slab->free = NULL;
+  slab->bump = slab->start;
+  slab->cls = cls;
+  slab->used = 0;
+  slab->capacity = (unsigned)((size_t)(slab->end - slab->start) /
+                              class_sizes[cls]);
+  slab->flags = 0;
+  slab->owner = heap;
+  slab_push(&heap->slabs[cls], slab);
+  heap->counts[cls] += slab->capacity;
+
+  return slab;
+}
+
+/*
+ * @brief Hands out an object of a slab with objects left, taking the slab
+ * off its owner's list once it is full. Only the owner may call this.
+ */
+static void *slab_alloc(slab_t *slab) {
+  void *obj = slab->free;
+
+  if (obj) {
+    slab->free = *(void **)obj;
+  } else {
+    obj = slab->bump;
+    slab->bump += class_sizes[slab->cls];
+  }
+
+  slab->owner->counts[slab->cls]--;
+  if (++slab->used == slab->capacity)
+    slab_unlink(&slab->owner->slabs[slab->cls], slab);
+
+  return obj;
+}
+
+/*
+ * @brief Gives an empty slab back to the shared pool, so any heap and size
+ * class may reuse it, and unmaps its chunk once every slab in it is empty if
+ * unmap_empty_chunks is set. Caller must hold global_malloc_lock.
+ */
+static void slab_retire(slab_t *slab) {
+  chunk_t *chunk = chunk_of(slab);
+  tcache_t *heap = slab->owner;
+
+  slab_unlink(&heap->slabs[slab->cls], slab);
+  heap->counts[slab->cls] -= slab->capacity;
+  slab->cls = NO_CLASS;
+  slab->owner = NULL;
+  slab_push(&empty_slabs[chunk->s.node], slab);
+  stat_free += (size_t)(slab->end - slab->start);
+
+  if (!--chunk->s.slabs_used && unmap_empty_chunks)
+    unmap_slab_chunk(chunk);
+  else
+    pending_release += SLAB_SIZE;
+}
+
+/*
+ * @brief Returns an object to its slab. Only the slab's owner may call this,
+ * or a holder of global_malloc_lock once the owner is abandoned.
+ *
+ * @return 1 if the slab is now empty and should be retired. The only slab of
+ * its class with objects left is kept, so a class that allocates and frees a
+ * handful of objects does not cycle through slabs.
+ */
+static int slab_free(void *obj) {
+  slab_t *slab = slab_of(obj);
+  tcache_t *heap = slab->owner;
+  unsigned cls = slab->cls;
+
+  if (slab->used == slab->capacity)
+    slab_push(&heap->slabs[cls], slab);
+
+  *(void **)obj = slab->free;
+  slab->free = obj;
+  heap->counts[cls]++;
+
+  return !--slab->used && (heap->slabs[cls] != slab || slab->next);
+}
+
+/*
+ * @brief Pushes an object freed by another thread onto the remote list of
+ * its slab's owner
+ */
+static inline void remote_free(tcache_t *owner, void *obj) {
+  void *head = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+
+  do {
+    *(void **)obj = head;
+  } while (!__atomic_compare_exchange_n(&owner->remote, &head, obj, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * @brief Takes a heap's whole remote list and returns the objects to their
+ * slabs, retiring the slabs that become empty. Only the heap's owner may
+ * call this, or a holder of global_malloc_lock once the heap is abandoned.
+ *
+ * @param locked Whether the caller holds global_malloc_lock
+ */
+static void heap_drain(tcache_t *heap, int locked) {
+  void *obj = __atomic_exchange_n(&heap->remote, NULL, __ATOMIC_ACQUIRE);
+
+  while (obj) {
+    void *next = *(void **)obj;
+
+    if (slab_free(obj)) {
+      if (!locked)
+        malloc_lock();
+      slab_retire(slab_of(obj));
+      if (!locked)
+        malloc_unlock();
+    }
+    obj = next;
+  }
+}
+
+/*
+ * @brief Drains a heap's remote list and retires all of its empty slabs,
+ * including the ones slab_free() keeps. Caller must hold global_malloc_lock
+ * and be the heap's owner, or the heap must be abandoned.
+ */
+static void heap_collect(tcache_t *heap) {
+  heap_drain(heap, 1);
+
+  for (unsigned cls = 0; cls < NUM_SIZE_CLASSES; cls++) {
+    slab_t *slab = heap->slabs[cls];
+
+    while (slab) {
+      slab_t *next = slab->next;
+      if (!slab->used)
+        slab_retire(slab);
+      slab = next;
+    }
+  }
+}
+
+
+/*
+ * @brief Gives the whole pages of a slab back to the OS. Caller must hold
+ * global_malloc_lock.
+ *
+ * @return 1 if any page was released, 0 otherwise
+ */
+static int release_slab(slab_t *slab) {
+  size_t page = page_size();
+  uintptr_t start = ((uintptr_t)slab->start + page - 1) & ~(page - 1);
+  uintptr_t end = (uintptr_t)slab->end;
+
+  /* Pages of a MAP_HUGETLB chunk are only given back with the chunk */
+  slab->flags |= SLAB_RELEASED;
+  if (end <= start || chunk_of(slab)->s.huge == CHUNK_HUGETLB)
+    return 0;
+
+  madvise((void *)start, end - start, MADV_DONTNEED);
+  SYSCALL_STAT(stat_madvises);
+  return 1;
+}
+
+/*
+ * @brief Gives the whole pages inside a free block back to the OS and takes
+ * it off its pool's release list. The pages holding the header, the links
+ * and the boundary tag stay resident. Caller must hold global_malloc_lock.
+ *
+ * @return 1 if any page was released, 0 otherwise
+ */
+static int release_block(block_pool_t *blocks, header_t *header) {
+  size_t page = page_size();
+  uintptr_t start = (uintptr_t)(RELEASE_LINKS(header) + 1);
+  uintptr_t end = (uintptr_t)FREE_FOOTER(header);
+
+  release_list_remove(blocks, header);
+  header->s.size |= BLOCK_RELEASED;
+
+  start = (start + page - 1) & ~(page - 1);
+  end &= ~(page - 1);
+  if (end <= start || chunk_of(header)->s.huge == CHUNK_HUGETLB)
+    return 0;
+
+  madvise((void *)start, end - start, MADV_DONTNEED);
+  SYSCALL_STAT(stat_madvises);
+  return 1;
+}
+
+/*
+ * @brief Unmaps the cached large mappings. Caller must hold
+ * global_malloc_lock.
+ *
+ * @return 1 if any mapping was unmapped, 0 otherwise
+ */
+static int release_large_cache(void) {
+  int released = 0;
+
+  for (unsigned i = 0; i < LARGE_CACHE_SLOTS; i++) {
+    chunk_t *chunk = large_cache[i];
+
+    if (!chunk)
+      continue;
+    large_cache[i] = NULL;
+    stat_mapped -= chunk->s.size;
+    munmap(chunk, chunk->s.size);
+    SYSCALL_STAT(stat_munmaps);
+    released = 1;
+  }
+  large_cache_bytes = 0;
+  return released;
+}
+
+/*
+ * @brief Gives the pages of free blocks, of empty slabs and of the uncarved
+ * tails of the pools' current chunks back to the OS, and unmaps the cached
+ * large mappings. Fully free chunks are unmapped.
+ * Caller must hold global_malloc_lock.
+ *
+ * @param idle_only Only release blocks that were already free at the previous
+ * pass, marking the others BLOCK_IDLE
+ *
+ * @return 1 if any memory was released, 0 otherwise
+ */
+static int release_free_pages(int idle_only) {
+  int released = 0;
+
+  for (unsigned i = 0; i <= numa_nodes; i++) {
+    block_pool_t *blocks = &block_pools[i];
+    header_t *header = blocks->releasable;
+
+    while (header) {
+      header_t *next = RELEASE_LINKS(header)->next;
+      chunk_t *chunk = chunk_of(header);
+
+      if (idle_only && !(header->s.size & BLOCK_IDLE)) {
+        header->s.size |= BLOCK_IDLE;
+      } else if (chunk != blocks->current &&
+                 header == (header_t *)(chunk + 1) && !next_block(header)) {
+        bin_remove(header);
+        unmap_chunk(chunk);
+        released = 1;
+      } else {
+        released |= release_block(blocks, header);
+      }
+      header = next;
+    }
+  }
+
+  if (!idle_only) {
+    for (chunk_t *chunk = chunk_list, *next; chunk; chunk = next) {
+      next = chunk->s.next;
+      if (chunk->s.kind == CHUNK_SLABS && !chunk->s.slabs_used) {
+        unmap_slab_chunk(chunk);
+        released = 1;
+      }
+    }
+  }
+
+  for (unsigned node = 0; node < numa_nodes; node++) {
+    for (slab_t *slab = empty_slabs[node]; slab; slab = slab->next) {
+      if (idle_only && !(slab->flags & SLAB_IDLE))
+        slab->flags |= SLAB_IDLE;
+      else if (!(slab->flags & SLAB_RELEASED))
+        released |= release_slab(slab);
+    }
+  }
+
+  for (unsigned i = 0; i <= numa_nodes && !idle_only; i++) {
+    chunk_t *chunk = block_pools[i].current;
+    size_t page = page_size();
+    uintptr_t start, end;
+
+    if (!chunk || chunk->s.huge == CHUNK_HUGETLB)
+      continue;
+
+    start = ((uintptr_t)chunk->s.top + page - 1) & ~(page - 1);
+    end = (uintptr_t)chunk + chunk->s.size;
+    if (end > start) {
+      madvise((void *)start, end - start, MADV_DONTNEED);
+      SYSCALL_STAT(stat_madvises);
+      released = 1;
+    }
+  }
+
+  released |= release_large_cache();
+
+  pending_release = 0;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &last_trim);
+
+  return released;
+}
+
+/*
+ * @brief Runs an automatic trim pass once enough free bytes have accumulated
+ * or trim_delay_ms has passed since the last one. Caller must hold
+ * global_malloc_lock.
+ */
+static void maybe_trim(void) {
+  struct timespec now;
+  size_t elapsed_ms;
+
+  if (!trim_threshold)
+    return;
+
+  if (pending_release < trim_threshold) {
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    elapsed_ms = (size_t)(now.tv_sec - last_trim.tv_sec) * 1000 +
+                 (size_t)(now.tv_nsec / 1000000) -
+                 (size_t)(last_trim.tv_nsec / 1000000);
+    if (elapsed_ms < trim_delay_ms)
+      return;
+  }
+
+  release_free_pages(1);
+}
+
+/*
+ * @brief Puts a free block back on the free lists, coalescing it with its
+ * free physical neighbours. Since neighbours are coalesced as soon as they are
+ * freed, at most one free block lies on each side: the next one is found from
+ * the block's size and the previous one from its boundary tag. A block ending
+ * at the top of its pool's current chunk is given back to the uncarved space
+ * instead, and a block spanning a whole chunk is unmapped if
+ * unmap_empty_chunks is set. Caller must hold global_malloc_lock.
+ *
+ * @param header Header of a block marked BLOCK_FREE
+ */
+static void insert_free_block(header_t *header) {
+  chunk_t *chunk = chunk_of(header);
+  chunk_t *current = blocks_of(header)->current;
+  header_t *tmp;
+
+  if ((tmp = next_block(header)) && (tmp->s.size & BLOCK_FREE)) {
+    bin_remove(tmp);
+    header->s.size += sizeof(header_t) + block_size(tmp);
+  }
+
+  if ((tmp = prev_free_block(header))) {
+    bin_remove(tmp);
+    tmp->s.size = (block_size(tmp) + sizeof(header_t) + block_size(header)) |
+                  BLOCK_FREE;
+    header = tmp;
+  }
+
+  if (chunk == current &&
+      (char *)(header + 1) + block_size(header) == current->s.top) {
+    current->s.top = (char *)header;
+    return;
+  }
+
+  if (unmap_empty_chunks && chunk != current &&
+      header == (header_t *)(chunk + 1) && !next_block(header)) {
+    unmap_chunk(chunk);
+    return;
+  }
+
+  bin_insert(header);
+}
+
+/*
+ * @brief Returns a block to the shared pool. Caller must hold
+ * global_malloc_lock.
+ *
+ * @param header Header of the block to free
+ */
+static void free_block(header_t *header) {
+  size_t size = block_size(header);
+
+  header->s.size |= BLOCK_FREE;
+  insert_free_block(header);
+
+  if (size >= page_size()) {
+    pending_release += size;
+    maybe_trim();
+  }
+}
+
+/*
+ * @brief Finds the smallest block of a bin that fits the given size
+ *
+ * @return The best fitting block, or NULL if none fits
+ */
+static header_t *best_in_bin(const block_pool_t *blocks, unsigned bin,
+                             size_t size) {
+  header_t *best = NULL;
+
+  for (header_t *curr = blocks->bins[bin]; curr;
+       curr = FREE_LINKS(curr)->next) {
+    if (block_size(curr) >= size &&
+        (!best || block_size(curr) < block_size(best))) {
+      best = curr;
+      if (block_size(best) == size)
+        break;
+    }
+  }
+  return best;
+}
+
+/*
+ * @brief Finds the first block of a bin that fits the given size
+ *
+ * @return The first fitting block, or NULL if none fits
+ */
+static header_t *first_in_bin(const block_pool_t *blocks, unsigned bin,
+                              size_t size) {
+  header_t *curr = blocks->bins[bin];
+
+  while (curr && block_size(curr) < size)
+    curr = FREE_LINKS(curr)->next;
+  return curr;
+}
+
+/*
+ * @brief Takes a block large enough for the given size off a pool's free
+ * lists. Only the starting bin may hold blocks that are too small, every later bin
+ * fits any of its blocks. Where the block comes from depends on the placement
+ * policy:
+ *
+ * PLACEMENT_FIRST_FIT_A: first fit in the starting bin, else the head of the
+ * next non-empty bin
+ * PLACEMENT_BEST_FIT_A: best fit in the starting bin, else the best fit in
+ * the next non-empty bin
+ * PLACEMENT_GOOD_FIT_A: the head of the next non-empty bin without scanning,
+ * falling back to first fit in the starting bin
+ *
+ * When the block would leave at least split_min bytes unused, the excess is
+ * split off and put back on the free lists. Caller must hold
+ * global_malloc_lock.
+ *
+ * @param blocks Pool to take the block from
+ * @param size Minimum size required in bytes
+ *
+ * @return Pointer to a suitable block, now marked allocated, or NULL
+ */
+static header_t *get_free_block(block_pool_t *blocks, size_t size) {
+  header_t *curr = NULL;
+  unsigned bin;
+  int next;
+
+  if (size < FREE_BLOCK_MIN)
+    size = FREE_BLOCK_MIN;
+  bin = size_to_bin(size);
+
+  if (placement == PLACEMENT_BEST_FIT_A)
+    curr = best_in_bin(blocks, bin, size);
+  else if (placement == PLACEMENT_FIRST_FIT_A)
+    curr = first_in_bin(blocks, bin, size);
+
+  if (!curr) {
+    next = next_nonempty_bin(blocks, bin + 1);
+    if (next >= 0)
+      curr = placement == PLACEMENT_BEST_FIT_A
+                 ? best_in_bin(blocks, (unsigned)next, 0)
+                 : blocks->bins[next];
+    else if (placement == PLACEMENT_GOOD_FIT_A)
+      curr = first_in_bin(blocks, bin, size);
+    if (!curr)
+      return NULL;
+  }
+
+  bin_remove(curr);
+  curr->s.size = block_size(curr);
+
+  if (curr->s.size - size >= sizeof(header_t) + split_min) {
+    header_t *rest = (header_t *)((char *)(curr + 1) + size);
+
+    rest->s.size = (curr->s.size - size - sizeof(header_t)) | BLOCK_FREE;
+    curr->s.size = size;
+    insert_free_block(rest);
+  }
+
+  stat_requested += size;
+  stat_handed_out += curr->s.size;
+  return curr;
+}
+
+/*
+ * @brief Resizes a block of the shared pool without moving it. Growing absorbs
+ * the free block physically following it, or the uncarved space when the
+ * block ends at the top of its pool's current chunk. The excess past the new size is
+ * split off and freed once it is at least split_min bytes, which also gives
+ * back the tail of a shrunk block. Caller must hold global_malloc_lock.
+ *
+ * @param header Header of an allocated block
+ * @param aligned_size New size in bytes excluding the header
+ *
+ * @return 1 if the block was resized, 0 if it has to move to grow
+ */
+static int resize_block(header_t *header, size_t aligned_size) {
+  size_t flags = header->s.size & BLOCK_PREV_FREE;
+  size_t size = block_size(header);
+  chunk_t *chunk = chunk_of(header);
+  header_t *next;
+
+  if (aligned_size > size) {
+    next = next_block(header);
+    if (next && (next->s.size & BLOCK_FREE) &&
+        size + sizeof(header_t) + block_size(next) >= aligned_size) {
+      bin_remove(next);
+      size += sizeof(header_t) + block_size(next);
+    } else if (!next && chunk == blocks_of(header)->current &&
+               (size_t)((char *)chunk + chunk->s.size - chunk->s.top) >=
+                   aligned_size - size) {
+      chunk->s.top += aligned_size - size;
+      size = aligned_size;
+    } else {
+      return 0;
+    }
+    stat_requested += aligned_size;
+  }
+
+  if (size - aligned_size >= sizeof(header_t) + split_min) {
+    header_t *rest = (header_t *)((char *)(header + 1) + aligned_size);
+
+    rest->s.size = size - aligned_size - sizeof(header_t);
+    size = aligned_size;
+    free_block(rest);
+  }
+
+  if (size > block_size(header))
+    stat_handed_out += size;
+  header->s.size = size | flags;
+  return 1;
+}
+
+/*
+ * Offset of a large block's memory from the start of its chunk. A block
+ * aligned beyond LARGE_OFFSET starts at an offset equal to its alignment
+ * instead, which keeps it aligned since the chunk is aligned to CHUNK_SIZE;
+ * the pages skipped in between are never touched. Alignments above
+ * CHUNK_BLOCK_MAX are multiples of CHUNK_SIZE: such a block starts right past
+ * the first chunk of a mapping placed to align it, where the byte before it
+ * still finds the chunk, see block_chunk().
+ */
+#define LARGE_OFFSET (sizeof(chunk_t) + sizeof(header_t))
+
+/*
+ * @brief Returns the offset of a large block's memory from the start of its
+ * chunk for an alignment, see LARGE_OFFSET
+ */
+static inline size_t large_offset(size_t align) {
+  if (align <= LARGE_OFFSET)
+    return LARGE_OFFSET;
+  return align <= CHUNK_BLOCK_MAX ? align : CHUNK_SIZE;
+}
+
+/*
+ * @brief Returns the size of the mapping holding a large block
+ *
+ * @param size Size of the block in bytes excluding the header
+ * @param offset Offset of the block's memory from the start of the chunk
+ *
+ * @return Mapping size in bytes, a multiple of the page size, or 0 on overflow
+ */
+static inline size_t large_map_size(size_t size, size_t offset) {
+  size_t page = page_size();
+  size_t overhead = offset + page - 1;
+
+  if (size > SIZE_MAX - overhead)
+    return 0;
+  return (size + overhead) & ~(page - 1);
+}
+
+/*
+ * @brief Sets the chunk and block sizes of a large block's mapping
+ */
+static inline void set_large_size(chunk_t *chunk, header_t *header,
+                                  size_t map_size) {
+  chunk->s.size = map_size;
+  chunk->s.top = (char *)chunk + map_size;
+  header->s.size = (size_t)(chunk->s.top - (char *)(header + 1));
+}
+
+/*
+ * @brief Fills in the chunk_t of a large block's new mapping, which normal
+ * pages back, like map_chunk() does for the other kinds
+ */
+static inline void init_large_chunk(chunk_t *chunk, unsigned node) {
+  chunk->s.kind = CHUNK_LARGE;
+  chunk->s.slabs_used = 0;
+  chunk->s.huge = 0;
+  chunk->s.node = node;
+}
+
+/*
+ * @brief Takes the smallest cached mapping of a node that is at least the
+ * given size and aligns a block as asked. The mapping no longer counts as
+ * mapped, as its new owner counts it like a fresh one. Caller must hold
+ * global_malloc_lock.
+ *
+ * @param map_size Size of the mapping in bytes
+ * @param node NUMA node of the mapping, or ANY_NODE
+ * @param offset Offset of the block's memory from the start of the mapping
+ * @param align Alignment of the block's memory
+ *
+ * @return Chunk of the mapping, or NULL if none fits
+ */
+static chunk_t *large_cache_take(size_t map_size, unsigned node,
+                                 size_t offset, size_t align) {
+  chunk_t *best = NULL;
+  unsigned slot = 0;
+
+  for (unsigned i = 0; i < LARGE_CACHE_SLOTS; i++) {
+    chunk_t *chunk = large_cache[i];
+
+    if (chunk && chunk->s.node == node && chunk->s.size >= map_size &&
+        !(((uintptr_t)chunk + offset) & (align - 1)) &&
+        (!best || chunk->s.size < best->s.size)) {
+      best = chunk;
+      slot = i;
+    }
+  }
+
+  if (best) {
+    large_cache[slot] = NULL;
+    large_cache_bytes -= best->s.size;
+    stat_mapped -= best->s.size;
+  }
+  return best;
+}
+
+/*
+ * @brief Keeps the mapping of a freed large block for later requests, unless
+ * the cache is full. Caller must hold global_malloc_lock.
+ *
+ * @return 1 if the mapping was cached, 0 if it has to be unmapped
+ */
+static int large_cache_put(chunk_t *chunk) {
+  if (chunk->s.size > LARGE_CACHE_MAX - large_cache_bytes)
+    return 0;
+
+  for (unsigned i = 0; i < LARGE_CACHE_SLOTS; i++) {
+    if (!large_cache[i]) {
+      large_cache[i] = chunk;
+      large_cache_bytes += chunk->s.size;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * @brief Allocates a block in a chunk of its own, reusing a cached mapping
+ * when one is large enough. The block then spans the whole mapping, so it
+ * grows in place up to that size. The global lock is only held to take a
+ * cached mapping and to link the chunk and block into their lists, never
+ * across mmap.
+ *
+ * @param size Size of the block in bytes excluding the header
+ * @param align Alignment of the block's memory, a power of two; any up to
+ * LARGE_OFFSET gives the plain layout
+ * @param node NUMA node to bind the mapping to, or ANY_NODE
+ *
+ * @return Pointer to the block's memory, or NULL on failure
+ */
+static void *malloc_large(size_t size, size_t align, unsigned node) {
+  size_t offset = large_offset(align);
+  size_t map_size = large_map_size(size, offset);
+  chunk_t *chunk;
+  header_t *header;
+
+  if (!map_size)
+    return NULL;
+
+  malloc_lock();
+  chunk = large_cache_take(map_size, node, offset, align);
+  malloc_unlock();
+
+  if (chunk) {
+    map_size = chunk->s.size;
+  } else {
+    chunk = (chunk_t *)map_region(map_size, 0, page_size(),
+                                  align > CHUNK_SIZE ? align : CHUNK_SIZE);
+    if (!chunk)
+      return NULL;
+    bind_to_node(chunk, map_size, node);
+    init_large_chunk(chunk, node);
+  }
+
+  header = (header_t *)((char *)chunk + offset) - 1;
+  set_large_size(chunk, header, map_size);
+
+  malloc_lock();
+  link_chunk(chunk);
+  stat_requested += size;
+  stat_handed_out += header->s.size;
+  stat_mapped += map_size;
+  malloc_unlock();
+
+  return (void *)(header + 1);
+}
+
+/*
+ * @brief Frees a large block, caching its chunk or unmapping it outside the
+ * global lock
+ */
+static void free_large(header_t *header) {
+  chunk_t *chunk = chunk_of(header);
+
+  malloc_lock();
+  unlink_chunk(chunk);
+  if (large_cache_put(chunk)) {
+    malloc_unlock();
+    return;
+  }
+  stat_mapped -= chunk->s.size;
+  malloc_unlock();
+
+  munmap(chunk, chunk->s.size);
+  SYSCALL_STAT(stat_munmaps);
+}
+
+/*
+ * @brief Resizes a large block without copying. Shrinking unmaps the trailing
+ * pages. Growing first tries to extend the mapping in place, and otherwise
+ * moves its pages with mremap to a new region aligned to CHUNK_SIZE, which
+ * keeps the block's alignment up to CHUNK_SIZE.
+ *
+ * @param header Header of the large block
+ * @param size New size in bytes
+ *
+ * @return Pointer to the resized block's memory, or NULL on failure
+ */
+static void *realloc_large(header_t *header, size_t size) {
+  chunk_t *chunk = chunk_of(header);
+  size_t offset = (size_t)((char *)(header + 1) - (char *)chunk);
+  size_t old_size = chunk->s.size;
+  size_t map_size = large_map_size(size, offset);
+  char *target;
+  void *moved;
+
+  if (!map_size)
+    return NULL;
+
+  if (map_size > old_size)
+    SYSCALL_STAT(stat_mremaps);
+  if (map_size <= old_size ||
+      mremap(chunk, old_size, map_size, 0) != MAP_FAILED) {
+    if (map_size < old_size) {
+      munmap((char *)chunk + map_size, old_size - map_size);
+      SYSCALL_STAT(stat_munmaps);
+    }
+    set_large_size(chunk, header, map_size);
+
+    malloc_lock();
+    stat_mapped += map_size - old_size;
+    malloc_unlock();
+    return (void *)(header + 1);
+  }
+
+  target = map_aligned(map_size);
+  if (!target)
+    return NULL;
+
+  /* Nobody else may touch the chunk's links while its pages move */
+  malloc_lock();
+  unlink_chunk(chunk);
+  malloc_unlock();
+
+  moved = mremap(chunk, old_size, map_size, MREMAP_MAYMOVE | MREMAP_FIXED,
+                 target);
+  SYSCALL_STAT(stat_mremaps);
+  if (moved == MAP_FAILED) {
+    munmap(target, map_size);
+    SYSCALL_STAT(stat_munmaps);
+  } else {
+    chunk = moved;
+    header = (header_t *)((char *)chunk + offset) - 1;
+    set_large_size(chunk, header, map_size);
+  }
+
+  malloc_lock();
+  stat_mapped += chunk->s.size - old_size;
+  link_chunk(chunk);
+  malloc_unlock();
+
+  return moved == MAP_FAILED ? NULL : (void *)(header + 1);
+}
+
+/*
+ * @struct pool
+ * @brief State of a pool_t, kept at the start of its first chunk.
+ */
+struct pool {
+  /* Protects the fields below */
+  alloc_lock_t lock;
+
+  /* Objects given back by full magazines, linked through their first word */
+  void *free;
+
+  /* Chunk objects are carved from; its top is where carving continues. The
+   * pool's earlier chunks are linked from it, see pool_chunk_link(). */
+  chunk_t *chunk;
+
+  /* Object size rounded up to the alignment, which is also the distance
+   * between objects, and the alignment */
+  size_t obj_size;
+  size_t align;
+
+  /* Index of the pool's magazine in every heap, the lowest one no other
+   * pool uses */
+  unsigned id;
+
+  /* Next pool in pool_list */
+  struct pool *next;
+};
+
+/*
+ * Every pool not yet destroyed in increasing id order, so fork() can hold
+ * their locks and a new pool finds a free id. pool_list_lock is taken before
+ * any pool lock.
+ */
+static struct pool *pool_list;
+static pthread_mutex_t pool_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * @brief Gives every object of a thread's magazine back to its pool
+ */
+static void magazine_flush(magazine_t *mag) {
+  struct pool *pool = mag->pool;
+
+  if (!mag->head)
+    return;
+
+  lock_acquire(&pool->lock);
+  while (mag->head) {
+    void *obj = mag->head;
+    mag->head = *(void **)obj;
+    *(void **)obj = pool->free;
+    pool->free = obj;
+  }
+  lock_release(&pool->lock);
+  mag->count = 0;
+}
+
+/*
+ * @brief Takes a heap for the calling thread, adopting an abandoned one if
+ * there is any and carving a new one from the heap pool otherwise. Caller
+ * must hold global_malloc_lock.
+ *
+ * @return The heap, or NULL if mmap failed
+ */
+static tcache_t *heap_take(void) {
+  size_t size = (sizeof(tcache_t) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+  tcache_t *heap = abandoned_heaps;
+
+  if (heap) {
+    abandoned_heaps = heap->next;
+    if (abandoned_heaps)
+      abandoned_heaps->prev = NULL;
+    return heap;
+  }
+
+  if (heap_pool_left < size) {
+    char *pool = mmap(NULL, HEAP_POOL_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    SYSCALL_STAT(stat_mmaps);
+
+    if (pool == MAP_FAILED)
+      return NULL;
+    heap_pool = pool;
+    heap_pool_left = HEAP_POOL_SIZE;
+  }
+
+  heap = (tcache_t *)heap_pool;
+  heap_pool += size;
+  heap_pool_left -= size;
+  return heap;
+}
+
+/*
+ * @brief Abandons a heap whose thread is gone and folds its counters into
+ * retired_stats. Empty slabs go back to the shared pool; slabs still in use
+ * stay with the heap until a new thread adopts it.
+ */
+static void heap_abandon(tcache_t *heap) {
+  /* Pool locks are never taken while holding global_malloc_lock */
+  for (unsigned i = 0; i < heap->mag_count; i++)
+    magazine_flush(&heap->mags[i]);
+
+  malloc_lock();
+  heap_collect(heap);
+
+  add_thread_stats(&retired_stats, &heap->stats);
+  memset(&heap->stats, 0, sizeof(heap->stats));
+
+  if (heap->prev)
+    heap->prev->next = heap->next;
+  else
+    tcache_list = heap->next;
+  if (heap->next)
+    heap->next->prev = heap->prev;
+
+  heap->prev = NULL;
+  heap->next = abandoned_heaps;
+  if (abandoned_heaps)
+    abandoned_heaps->prev = heap;
+  abandoned_heaps = heap;
+  malloc_unlock();
+}
+
+static void trace_thread_exit(void);
+
+/*
+ * @brief Abandons the calling thread's heap. Registered as the tcache_key
+ * destructor so it runs when the thread exits.
+ */
+static void tcache_destroy(void *arg) {
+  trace_thread_exit();
+  heap_abandon(arg);
+
+  /* Later destructors that allocate use the shared pool */
+  tcache = NULL;
+  tcache_state = TCACHE_EXITED;
+}
+
+static void tcache_key_init(void) {
+  pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+/*
+ * @brief Gives the calling thread a heap, registers it for abandoning at
+ * thread exit and links it into the list stats_a() sums up
+ *
+ * @return 0 on success, -1 if no heap could be mapped or the thread may not
+ * take one, see tcache_state
+ */
+static int tcache_register(void) {
+  tcache_t *heap;
+
+  if (tcache_state != TCACHE_NONE)
+    return -1;
+  tcache_state = TCACHE_REGISTERING;
+
+  pthread_once(&tcache_key_once, tcache_key_init);
+
+  malloc_lock();
+  heap = heap_take();
+  if (heap) {
+    heap->prev = NULL;
+    heap->next = tcache_list;
+    if (tcache_list)
+      tcache_list->prev = heap;
+    tcache_list = heap;
+  }
+  malloc_unlock();
+
+  if (!heap) {
+    tcache_state = TCACHE_NONE;
+    return -1;
+  }
+
+  heap->node = current_node();
+  tcache = heap;
+  pthread_setspecific(tcache_key, heap);
+  tcache_state = TCACHE_REGISTERED;
+  return 0;
+}
+
+/*
+ * @brief Finds a slab with objects left for a size class once the heap's
+ * list is empty: objects freed by other threads come back first, and a new
+ * slab is taken from the shared pool only if none of them was of the class.
+ *
+ * @param cls Size class of the slab
+ *
+ * @return The slab, or NULL if no slab could be obtained
+ */
+static slab_t *tcache_refill(unsigned cls) {
+  slab_t *slab;
+
+  heap_drain(tcache, 0);
+  if (tcache->slabs[cls])
+    return tcache->slabs[cls];
+
+  malloc_lock();
+  slab = slab_assign(tcache, cls);
+  malloc_unlock();
+
+  return slab;
+}
+
+/*
+ * @brief Allocates a small object from the calling thread's heap, which must
+ * be registered
+ *
+ * @param cls Size class of the object
+ * @param size Size requested in bytes, for the statistics
+ *
+ * @return Pointer to the object, or NULL on failure
+ */
+static void *malloc_small(unsigned cls, size_t size) {
+  slab_t *slab = tcache->slabs[cls];
+  void *block;
+
+  if (!slab && !(slab = tcache_refill(cls)))
+    return NULL;
+
+  block = slab_alloc(slab);
+  STAT_ADD(malloc_count, 1);
+  STAT_ADD(bytes_allocated, class_sizes[cls]);
+  STAT_ADD(small_requested, size);
+  STAT_ADD(small_handed_out, class_sizes[cls]);
+  return block;
+}
+
+/*
+ * The heap profiler samples allocations as a Poisson process over the bytes
+ * allocated: each thread counts down an exponentially distributed number of
+ * bytes with mean profile_interval, and the allocation that crosses zero is
+ * recorded along with its call stack. Sampled allocations still allocated are
+ * kept in a hash table under profile_lock, which comes after every other lock
+ * of the allocator, and dumped by profile_dump_a(). While profile_interval is
+ * 0 an allocation only pays a test of it.
+ */
+#define PROFILE_DEPTH 32
+#define PROFILE_BUCKETS 4096
+#define PROFILE_RECORDS_SIZE (64UL << 10)
+
+/*
+ * Counters of sampled allocations by hash of address. A free only looks the
+ * block up under profile_lock when its counter is nonzero, which it always is
+ * for a sampled block still allocated.
+ */
+#define PROFILE_FILTER 16384
+
+/*
+ * @struct sample_t
+ * @brief Sampled allocation not freed yet
+ */
+typedef struct sample {
+  struct sample *next;
+  void *block;
+  size_t size;
+
+  /* Dump that last counted the sample, see profile_write() */
+  unsigned dumped;
+
+  /* Return addresses of the call stack, innermost first */
+  int depth;
+  void *stack[PROFILE_DEPTH];
+} sample_t;
+
+/*
+ * Sampling interval, and the last nonzero one, which the samples still
+ * allocated were taken with
+ */
+static size_t profile_interval;
+static size_t profile_period;
+
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static sample_t *profile_buckets[PROFILE_BUCKETS];
+static unsigned profile_filter[PROFILE_FILTER];
+
+/*
+ * Records of freed samples, and the mapping new records are carved from
+ */
+static sample_t *free_samples;
+static char *sample_pool;
+static size_t sample_pool_left;
+
+/*
+ * Signal dumping the profile to a file, a dump requested by the signal while
+ * profile_lock was held, and the number of dumps written to files
+ */
+static int profile_signal;
+static int profile_dump_pending;
+static unsigned profile_dumps;
+static unsigned profile_dump_seq;
+
+/*
+ * Bytes left before this thread's next sample, the state of its random number
+ * generator, and whether it is recording a sample, during which its own
+ * allocations, made by backtrace(), are not sampled
+ */
+static __thread size_t sample_left __attribute__((tls_model("initial-exec")));
+static __thread uint64_t sample_rng __attribute__((tls_model("initial-exec")));
+static __thread int in_profiler __attribute__((tls_model("initial-exec")));
+
+/*
+ * @brief Returns the natural logarithm of a positive double, without libm
+ */
+static double sample_log(double x) {
+  uint64_t bits;
+  double m, t, t2;
+  int e;
+
+  memcpy(&bits, &x, sizeof(bits));
+  e = (int)((bits >> 52) & 0x7ff) - 1023;
+  bits = (bits & ((1ULL << 52) - 1)) | (1023ULL << 52);
+  memcpy(&m, &bits, sizeof(m));
+
+  /* ln(m) = 2 atanh((m - 1) / (m + 1)) for m in [1, 2) */
+  t = (m - 1) / (m + 1);
+  t2 = t * t;
+  return e * 0.6931471805599453 +
+         2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7 +
+                                                             t2 / 9))));
+}
+
+/*
+ * @brief Draws the number of bytes until the next sample, exponentially
+ * distributed with mean profile_interval
+ */
+static size_t sample_next(void) {
+  double u;
+
+  if (!sample_rng)
+    sample_rng = (uintptr_t)&sample_rng ^ (uint64_t)time(NULL) << 32 ^
+                 0x9e3779b97f4a7c15ULL;
+  sample_rng ^= sample_rng << 13;
+  sample_rng ^= sample_rng >> 7;
+  sample_rng ^= sample_rng << 17;
+
+  /* Uniform in (0, 1] */
+  u = (double)((sample_rng >> 11) + 1) / (double)(1ULL << 53);
+  return (size_t)(-sample_log(u) * (double)profile_interval) + 1;
+}
+
+static inline unsigned sample_hash(const void *block) {
+  return (unsigned)(((uintptr_t)block >> 4) * 0x9e3779b97f4a7c15ULL >> 40);
+}
+
+/*
+ * @brief Takes a record for a new sample. Caller must hold profile_lock.
+ *
+ * @return The record, or NULL if mmap failed
+ */
+static sample_t *sample_take(void) {
+  sample_t *sample = free_samples;
+
+  if (sample) {
+    free_samples = sample->next;
+    return sample;
+  }
+
+  if (sample_pool_left < sizeof(sample_t)) {
+    char *pool = mmap(NULL, PROFILE_RECORDS_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    SYSCALL_STAT(stat_mmaps);
+
+    if (pool == MAP_FAILED)
+      return NULL;
+    sample_pool = pool;
+    sample_pool_left = PROFILE_RECORDS_SIZE;
+  }
+
+  sample = (sample_t *)sample_pool;
+  sample_pool += sizeof(sample_t);
+  sample_pool_left -= sizeof(sample_t);
+  return sample;
+}
+
+static void profile_dump_file(void);
+
+/*
+ * @brief Releases profile_lock, then writes a dump the profile signal asked
+ * for while it was held
+ */
+static void profile_unlock(void) {
+  pthread_mutex_unlock(&profile_lock);
+
+  if (__builtin_expect(
+          __atomic_load_n(&profile_dump_pending, __ATOMIC_RELAXED), 0) &&
+      !pthread_mutex_trylock(&profile_lock)) {
+    __atomic_store_n(&profile_dump_pending, 0, __ATOMIC_RELAXED);
+    profile_dump_file();
+    pthread_mutex_unlock(&profile_lock);
+  }
+}
+
+/*
+ * @brief Counts an allocation down against the thread's sampling interval,
+ * recording it with its call stack when the count crosses zero
+ */
+__attribute__((noinline)) static void sample_alloc(void *block, size_t size) {
+  void *stack[PROFILE_DEPTH + 1];
+  sample_t *sample;
+  unsigned hash;
+  int depth;
+
+  if (in_profiler)
+    return;
+  if (!sample_left)
+    sample_left = sample_next();
+  if (size < sample_left) {
+    sample_left -= size;
+    return;
+  }
+  sample_left = sample_next();
+
+  /* backtrace() may allocate, and the first call loads libgcc */
+  in_profiler = 1;
+  depth = backtrace(stack, PROFILE_DEPTH + 1) - 1;
+  in_profiler = 0;
+
+  hash = sample_hash(block);
+  pthread_mutex_lock(&profile_lock);
+  sample = sample_take();
+  if (sample) {
+    sample->block = block;
+    sample->size = size;
+    sample->dumped = profile_dump_seq;
+    sample->depth = depth > 0 ? depth : 0;
+    if (depth > 0)
+      memcpy(sample->stack, stack + 1, (size_t)depth * sizeof(void *));
+    sample->next = profile_buckets[hash % PROFILE_BUCKETS];
+    profile_buckets[hash % PROFILE_BUCKETS] = sample;
+    __atomic_fetch_add(&profile_filter[hash % PROFILE_FILTER], 1,
+                       __ATOMIC_RELAXED);
+  }
+  profile_unlock();
+}
+
+/*
+ * @brief Forgets the sample of a block being freed, if it has one
+ */
+__attribute__((noinline)) static void sample_free(void *block) {
+  unsigned hash = sample_hash(block);
+  sample_t **link;
+
+  pthread_mutex_lock(&profile_lock);
+  for (link = &profile_buckets[hash % PROFILE_BUCKETS]; *link;
+       link = &(*link)->next) {
+    sample_t *sample = *link;
+
+    if (sample->block == block) {
+      *link = sample->next;
+      sample->next = free_samples;
+      free_samples = sample;
+      __atomic_fetch_sub(&profile_filter[hash % PROFILE_FILTER], 1,
+                         __ATOMIC_RELAXED);
+      break;
+    }
+  }
+  profile_unlock();
+}
+
+static inline void profile_alloc(void *block, size_t size) {
+  if (__builtin_expect(
+          __atomic_load_n(&profile_interval, __ATOMIC_RELAXED) != 0, 0) &&
+      block)
+    sample_alloc(block, size);
+}
+
+static inline void profile_free(void *block) {
+  if (__builtin_expect(
+          __atomic_load_n(&profile_filter[sample_hash(block) % PROFILE_FILTER],
+                          __ATOMIC_RELAXED) != 0,
+          0))
+    sample_free(block);
+}
+
+/*
+ * @struct profile_out_t
+ * @brief Buffered output to a file descriptor, made without stdio so that a
+ * profile can be written from a signal handler and never allocates
+ */
+typedef struct profile_out {
+  int fd;
+  int failed;
+  size_t len;
+  char buf[4096];
+} profile_out_t;
+
+static void out_flush(profile_out_t *out) {
+  char *p = out->buf;
+
+  while (out->len && !out->failed) {
+    ssize_t n = write(out->fd, p, out->len);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      out->failed = 1;
+      break;
+    }
+    p += n;
+    out->len -= (size_t)n;
+  }
+  out->len = 0;
+}
+
+static void out_str(profile_out_t *out, const char *str, size_t len) {
+  while (len) {
+    size_t n = sizeof(out->buf) - out->len;
+
+    if (n > len)
+      n = len;
+    memcpy(out->buf + out->len, str, n);
+    out->len += n;
+    str += n;
+    len -= n;
+    if (out->len == sizeof(out->buf))
+      out_flush(out);
+  }
+}
+
+#define OUT_LITERAL(out, str) out_str(out, str, sizeof(str) - 1)
+
+static void out_num(profile_out_t *out, uint64_t value, unsigned base) {
+  char digits[24];
+  size_t i = sizeof(digits);
+
+  do {
+    digits[--i] = "0123456789abcdef"[value % base];
+    value /= base;
+  } while (value);
+  out_str(out, digits + i, sizeof(digits) - i);
+}
+
+/*
+ * @brief Writes a line of the heap profile: objects and bytes in use, twice,
+ * since only allocations not freed yet are kept
+ */
+static void out_counts(profile_out_t *out, size_t objects, size_t bytes) {
+  out_num(out, objects, 10);
+  OUT_LITERAL(out, ": ");
+  out_num(out, bytes, 10);
+  OUT_LITERAL(out, " [");
+  out_num(out, objects, 10);
+  OUT_LITERAL(out, ": ");
+  out_num(out, bytes, 10);
+  OUT_LITERAL(out, "]");
+}
+
+/*
+ * @brief Writes the profile in the legacy text heap format of pprof: a header
+ * with the totals and the sampling interval, a line per call stack, then the
+ * mappings of the process for symbolization. Counts are those of the samples;
+ * pprof scales them by the sampling interval. Caller must hold profile_lock.
+ *
+ * @return 0 on success, -1 if writing failed
+ */
+static int profile_write(int fd) {
+  profile_out_t out = {.fd = fd};
+  size_t objects = 0, bytes = 0;
+  char maps[1024];
+  ssize_t n;
+  int maps_fd;
+
+  profile_dump_seq++;
+  for (unsigned b = 0; b < PROFILE_BUCKETS; b++) {
+    for (sample_t *s = profile_buckets[b]; s; s = s->next) {
+      objects++;
+      bytes += s->size;
+    }
+  }
+
+  OUT_LITERAL(&out, "heap profile: ");
+  out_counts(&out, objects, bytes);
+  OUT_LITERAL(&out, " @ heap_v2/");
+  out_num(&out, profile_period, 10);
+  OUT_LITERAL(&out, "\n");
+
+  /* Samples with the same call stack are summed into one line */
+  for (unsigned b = 0; b < PROFILE_BUCKETS; b++) {
+    for (sample_t *s = profile_buckets[b]; s; s = s->next) {
+      if (s->dumped == profile_dump_seq)
+        continue;
+
+      objects = 0;
+      bytes = 0;
+      for (unsigned c = b; c < PROFILE_BUCKETS; c++) {
+        for (sample_t *t = c == b ? s : profile_buckets[c]; t; t = t->next) {
+          if (t->dumped == profile_dump_seq || t->depth != s->depth ||
+              memcmp(t->stack, s->stack, (size_t)s->depth * sizeof(void *)))
+            continue;
+          t->dumped = profile_dump_seq;
+          objects++;
+          bytes += t->size;
+        }
+      }
+
+      out_counts(&out, objects, bytes);
+      OUT_LITERAL(&out, " @");
+      for (int i = 0; i < s->depth; i++) {
+        OUT_LITERAL(&out, " 0x");
+        out_num(&out, (uintptr_t)s->stack[i], 16);
+      }
+      OUT_LITERAL(&out, "\n");
+    }
+  }
+
+  OUT_LITERAL(&out, "\nMAPPED_LIBRARIES:\n");
+  maps_fd = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (maps_fd >= 0) {
+    while ((n = read(maps_fd, maps, sizeof(maps))) > 0 ||
+           (n < 0 && errno == EINTR))
+      if (n > 0)
+        out_str(&out, maps, (size_t)n);
+    close(maps_fd);
+  }
+
+  out_flush(&out);
+  return out.failed ? -1 : 0;
+}
+
+/*
+ * @brief Writes the profile to heap.<pid>.<n>.prof in the working directory.
+ * Caller must hold profile_lock.
+ */
+static void profile_dump_file(void) {
+  profile_out_t name = {.fd = -1};
+  int fd;
+
+  OUT_LITERAL(&name, "heap.");
+  out_num(&name, (uint64_t)getpid(), 10);
+  OUT_LITERAL(&name, ".");
+  out_num(&name, profile_dumps++, 10);
+  OUT_LITERAL(&name, ".prof");
+  name.buf[name.len] = '\0';
+
+  fd = open(name.buf, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return;
+  profile_write(fd);
+  close(fd);
+}
+
+/*
+ * @brief Handler of the profile signal. When profile_lock is held, the dump
+ * is left to the next thread releasing it.
+ */
+static void profile_signal_handler(int sig) {
+  int saved_errno = errno;
+
+  (void)sig;
+  if (pthread_mutex_trylock(&profile_lock)) {
+    __atomic_store_n(&profile_dump_pending, 1, __ATOMIC_RELAXED);
+  } else {
+    profile_dump_file();
+    pthread_mutex_unlock(&profile_lock);
+  }
+  errno = saved_errno;
+}
+
+/*
+ * @brief Sets the sampling interval, loading what backtrace() needs before
+ * the first sample, or the signal dumping the profile
+ *
+ * @return 1 on success, 0 if the signal cannot be handled
+ */
+static int profile_config(int param, size_t value) {
+  struct sigaction action;
+
+  if (param == M_PROFILE_A) {
+    if (value) {
+      void *frame;
+
+      backtrace(&frame, 1);
+      pthread_mutex_lock(&profile_lock);
+      profile_period = value;
+      pthread_mutex_unlock(&profile_lock);
+    }
+    __atomic_store_n(&profile_interval, value, __ATOMIC_RELAXED);
+    return 1;
+  }
+
+  if (value >= (size_t)NSIG)
+    return 0;
+
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  if (profile_signal) {
+    action.sa_handler = SIG_DFL;
+    sigaction(profile_signal, &action, NULL);
+    profile_signal = 0;
+  }
+  if (value) {
+    action.sa_handler = profile_signal_handler;
+    if (sigaction((int)value, &action, NULL))
+      return 0;
+    profile_signal = (int)value;
+  }
+  return 1;
+}
+
+int profile_dump_a(int fd) {
+  int ret;
+
+  pthread_mutex_lock(&profile_lock);
+  ret = profile_write(fd);
+  pthread_mutex_unlock(&profile_lock);
+  return ret;
+}
+
+/*
+ * Size of a thread's trace buffer, and the largest encoded event, which must
+ * still fit before the buffer is written out
+ */
+#define TRACE_BUFFER_SIZE (64UL << 10)
+#define TRACE_EVENT_MAX 64
+
+/*
+ * @struct trace_buffer_t
+ * @brief Events of one thread not written to the trace file yet. Buffers are
+ * never unmapped; the buffer of an exited thread goes to the next thread that
+ * records an event, under the same thread number.
+ */
+typedef struct trace_buffer {
+  /* Next buffer of trace_buffers */
+  struct trace_buffer *next;
+
+  /* Taken by the owner for each event, and by trace_stop_a() */
+  alloc_lock_t lock;
+
+  /* Whether a thread records into the buffer */
+  int owned;
+
+  /* Sequence number and address the next event is encoded relative to */
+  uint64_t last_seq;
+  uintptr_t last_block;
+
+  /* Block header, thread number and byte count, followed by the events */
+  size_t length;
+  unsigned char data[TRACE_BUFFER_SIZE];
+} trace_buffer_t;
+
+/*
+ * Whether events are recorded, and the trace file, kept until every buffer
+ * was written out after recording stopped
+ */
+static int trace_active;
+static int trace_fd = -1;
+
+/*
+ * Next sequence number, and the number of buffers, each a thread number
+ */
+static uint64_t trace_seq;
+static uint32_t trace_threads;
+
+/*
+ * Protects the buffer list and trace_fd, and keeps the blocks of different
+ * threads from interleaving in the file
+ */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static trace_buffer_t *trace_buffers;
+
+static __thread trace_buffer_t *trace_buffer
+    __attribute__((tls_model("initial-exec")));
+
+/*
+ * @brief Writes all of a buffer to a file descriptor
+ *
+ * @return 0 on success, -1 if writing failed
+ */
+static int write_all(int fd, const void *data, size_t size) {
+  const char *p = data;
+
+  while (size) {
+    ssize_t n = write(fd, p, size);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    p += n;
+    size -= (size_t)n;
+  }
+  return 0;
+}
+
+/*
+ * @brief Writes a buffer's events to the trace file as one block and empties
+ * the buffer. Caller must hold the buffer's lock.
+ */
+static void trace_flush(trace_buffer_t *buffer) {
+  uint32_t length = (uint32_t)(buffer->length - 2 * sizeof(uint32_t));
+
+  if (length) {
+    memcpy(buffer->data + sizeof(uint32_t), &length, sizeof(length));
+    pthread_mutex_lock(&trace_lock);
+    if (trace_fd >= 0)
+      write_all(trace_fd, buffer->data, buffer->length);
+    pthread_mutex_unlock(&trace_lock);
+  }
+
+  buffer->length = 2 * sizeof(uint32_t);
+  buffer->last_seq = 0;
+  buffer->last_block = 0;
+}
+
+/*
+ * @brief Gives the calling thread a trace buffer, an unowned one if there is
+ * any
+ *
+ * @return The buffer, or NULL if mmap failed
+ */
+static trace_buffer_t *trace_attach(void) {
+  trace_buffer_t *buffer;
+
+  pthread_mutex_lock(&trace_lock);
+  for (buffer = trace_buffers; buffer && buffer->owned; buffer = buffer->next)
+    ;
+
+  if (!buffer) {
+    buffer = mmap(NULL, sizeof(trace_buffer_t), PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    SYSCALL_STAT(stat_mmaps);
+    if (buffer == MAP_FAILED) {
+      pthread_mutex_unlock(&trace_lock);
+      return NULL;
+    }
+
+    lock_init(&buffer->lock);
+    memcpy(buffer->data, &trace_threads, sizeof(uint32_t));
+    trace_threads++;
+    buffer->length = 2 * sizeof(uint32_t);
+    buffer->next = trace_buffers;
+    __atomic_store_n(&trace_buffers, buffer, __ATOMIC_RELEASE);
+  }
+  buffer->owned = 1;
+  pthread_mutex_unlock(&trace_lock);
+
+  trace_buffer = buffer;
+  return buffer;
+}
+
+/*
+ * @brief Writes out the calling thread's events and gives up its buffer.
+ * Called when the thread exits.
+ */
+static void trace_thread_exit(void) {
+  trace_buffer_t *buffer = trace_buffer;
+
+  if (!buffer)
+    return;
+
+  lock_acquire(&buffer->lock);
+  trace_flush(buffer);
+  lock_release(&buffer->lock);
+
+  pthread_mutex_lock(&trace_lock);
+  buffer->owned = 0;
+  pthread_mutex_unlock(&trace_lock);
+  trace_buffer = NULL;
+}
+
+static inline unsigned char *trace_varint(unsigned char *out, uint64_t value) {
+  while (value >= 0x80) {
+    *out++ = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  *out++ = (unsigned char)value;
+  return out;
+}
+
+/*
+ * @brief Encodes an address as the zigzag difference from the previous one
+ */
+static inline unsigned char *trace_block(unsigned char *out,
+                                         trace_buffer_t *buffer,
+                                         const void *block) {
+  uintptr_t address = (uintptr_t)block;
+  int64_t delta = (int64_t)(address - buffer->last_block);
+
+  buffer->last_block = address;
+  return trace_varint(out, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+}
+
+/*
+ * @brief Appends an event to the calling thread's buffer, see TRACE_MAGIC_A
+ *
+ * @param op One of the TRACE_*_A events
+ * @param block Block allocated, resized or freed
+ * @param old Block realloc_a() was given, alignment of TRACE_ALIGNED_A
+ * @param size Size requested
+ */
+__attribute__((noinline)) static void trace_event(int op, void *block,
+                                                  uintptr_t old, size_t size) {
+  trace_buffer_t *buffer = trace_buffer;
+  unsigned char *out;
+  uint64_t seq;
+
+  if (!buffer && !(buffer = trace_attach()))
+    return;
+
+  lock_acquire(&buffer->lock);
+
+  /* Recording may have stopped, and this buffer been written out, since the
+   * caller checked */
+  if (!__atomic_load_n(&trace_active, __ATOMIC_RELAXED)) {
+    lock_release(&buffer->lock);
+    return;
+  }
+
+  seq = __atomic_fetch_add(&trace_seq, 1, __ATOMIC_RELAXED);
+  out = buffer->data + buffer->length;
+  *out++ = (unsigned char)op;
+  out = trace_varint(out, seq - buffer->last_seq);
+  buffer->last_seq = seq;
+
+  switch (op) {
+  case TRACE_MALLOC_A:
+  case TRACE_CALLOC_A:
+    out = trace_varint(out, size);
+    out = trace_block(out, buffer, block);
+    break;
+  case TRACE_ALIGNED_A:
+    out = trace_varint(out, old);
+    out = trace_varint(out, size);
+    out = trace_block(out, buffer, block);
+    break;
+  case TRACE_REALLOC_A:
+    out = trace_block(out, buffer, (void *)old);
+    out = trace_varint(out, size);
+    out = trace_block(out, buffer, block);
+    break;
+  case TRACE_FREE_A:
+    out = trace_block(out, buffer, block);
+    break;
+  case TRACE_FREE_SIZED_A:
+    out = trace_block(out, buffer, block);
+    out = trace_varint(out, size);
+    break;
+  }
+
+  buffer->length = (size_t)(out - buffer->data);
+  if (buffer->length > TRACE_BUFFER_SIZE - TRACE_EVENT_MAX)
+    trace_flush(buffer);
+  lock_release(&buffer->lock);
+}
+
+/*
+ * @brief Records an allocation, after it was made so that the block cannot
+ * be freed by another thread before
+ */
+static inline void trace_alloc(int op, void *block, uintptr_t old,
+                               size_t size) {
+  if (__builtin_expect(__atomic_load_n(&trace_active, __ATOMIC_RELAXED), 0) &&
+      block)
+    trace_event(op, block, old, size);
+}
+
+/*
+ * @brief Records a free, before it is made so that the block cannot be
+ * allocated again by another thread before
+ */
+static inline void trace_free(int op, void *block, size_t size) {
+  if (__builtin_expect(__atomic_load_n(&trace_active, __ATOMIC_RELAXED), 0) &&
+      block)
+    trace_event(op, block, 0, size);
+}
+
+int trace_start_a(int fd) {
+  int ret = -1;
+
+  pthread_mutex_lock(&trace_lock);
+  if (trace_fd < 0 && !write_all(fd, TRACE_MAGIC_A, 8)) {
+    trace_fd = fd;
+    __atomic_store_n(&trace_active, 1, __ATOMIC_RELAXED);
+    ret = 0;
+  }
+  pthread_mutex_unlock(&trace_lock);
+  return ret;
+}
+
+int trace_stop_a(void) {
+  trace_buffer_t *buffer;
+
+  pthread_mutex_lock(&trace_lock);
+  if (!__atomic_load_n(&trace_active, __ATOMIC_RELAXED)) {
+    pthread_mutex_unlock(&trace_lock);
+    return -1;
+  }
+  __atomic_store_n(&trace_active, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&trace_lock);
+
+  /* Buffers are only ever added at the head of the list */
+  for (buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer;
+       buffer = buffer->next) {
+    lock_acquire(&buffer->lock);
+    trace_flush(buffer);
+    lock_release(&buffer->lock);
+  }
+
+  pthread_mutex_lock(&trace_lock);
+  trace_fd = -1;
+  pthread_mutex_unlock(&trace_lock);
+  return 0;
+}
+
+/*
+ * @brief Body of malloc_a(), timed by it under ALLOCATOR_TIMING
+ */
+__attribute__((always_inline)) static inline void *malloc_untimed(size_t size) {
+  header_t *header;
+  void *block;
+
+  if (!size)
+    return NULL;
+
+  /* Without a heap, small requests get a block of the shared pool */
+  if (__builtin_expect(!tcache, 0))
+    tcache_register();
+
+  if (size <= SMALL_SIZE_MAX && __builtin_expect(tcache != NULL, 1)) {
+    block = malloc_small(size_to_class(size), size);
+    profile_alloc(block, size);
+    return block;
+  }
+
+  if (size > SIZE_MAX - _Alignof(max_align_t) + 1) {
+    return NULL;
+  }
+
+  size_t aligned_size =
+      (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+
+  if (aligned_size > SIZE_MAX - sizeof(header_t)) {
+    return NULL;
+  }
+
+  if (aligned_size > mmap_threshold) {
+    block = malloc_large(aligned_size, _Alignof(max_align_t), ANY_NODE);
+    if (!block)
+      return NULL;
+    header = (header_t *)block - 1;
+  } else {
+    malloc_lock();
+    header = get_free_block(SHARED_BLOCKS, aligned_size);
+    if (!header)
+      header = map_block(SHARED_BLOCKS, aligned_size);
+    malloc_unlock();
+
+    if (!header)
+      return NULL;
+  }
+
+  STAT_ADD(malloc_count, 1);
+  STAT_ADD(bytes_allocated, block_size(header));
+  profile_alloc(header + 1, size);
+  return (void *)(header + 1);
+}
+
+/*
+ * @brief malloc_a() without tracing, for the entry points built on it
+ */
+__attribute__((always_inline)) static inline void *
+malloc_untraced(size_t size) {
+#ifdef ALLOCATOR_TIMING
+  unsigned op = timing_op;
+  uint64_t start;
+  void *block;
+
+  timing_op = LOCK_OP_MALLOC_A;
+  start = timing_now();
+  block = malloc_untimed(size);
+  TIMING_RECORD(malloc_ns, timing_now() - start);
+  timing_op = op;
+  return block;
+#else
+  return malloc_untimed(size);
+#endif
+}
+
+void *malloc_a(size_t size) {
+  void *block = malloc_untraced(size);
+
+  trace_alloc(TRACE_MALLOC_A, block, 0, size);
+  return block;
+}
+
+/*
+ * @brief Returns a small object to its slab, or to the remote list of the
+ * slab's owner when the object belongs to another thread's heap
+ */
+static inline void free_small(slab_t *slab, void *block) {
+  if (slab->owner != tcache) {
+    remote_free(slab->owner, block);
+  } else if (slab_free(block)) {
+    malloc_lock();
+    slab_retire(slab);
+    malloc_unlock();
+  }
+}
+
+/*
+ * @brief Allocates a small object from the heap of a NUMA node, creating the
+ * heap on first use. The heap is only used under its lock, which makes the
+ * holder its owner; objects freed to it come back through its remote list.
+ *
+ * @return Pointer to the object, or NULL on failure
+ */
+static void *malloc_node_small(unsigned cls, size_t size, unsigned node) {
+  slab_t *slab = NULL;
+  tcache_t *heap;
+  void *block;
+
+  lock_acquire(&node_heap_locks[node]);
+  heap = node_heaps[node];
+  if (!heap) {
+    malloc_lock();
+    heap = heap_take();
+    malloc_unlock();
+    if (heap) {
+      heap->node = node;
+      node_heaps[node] = heap;
+    }
+  }
+
+  if (heap) {
+    heap_drain(heap, 0);
+    slab = heap->slabs[cls];
+    if (!slab) {
+      malloc_lock();
+      slab = slab_assign(heap, cls);
+      malloc_unlock();
+    }
+  }
+
+  block = slab ? slab_alloc(slab) : NULL;
+  lock_release(&node_heap_locks[node]);
+
+  if (block) {
+    STAT_ADD(malloc_count, 1);
+    STAT_ADD(bytes_allocated, class_sizes[cls]);
+    STAT_ADD(small_requested, size);
+    STAT_ADD(small_handed_out, class_sizes[cls]);
+  }
+  return block;
+}
+
+void *malloc_node_a(size_t size, int node) {
+  size_t aligned_size;
+  block_pool_t *blocks;
+  header_t *header;
+  void *block;
+
+  if (!size || node < 0 || (unsigned)node >= numa_nodes)
+    return NULL;
+
+  if (__builtin_expect(!tcache, 0))
+    tcache_register();
+
+  if (size <= SMALL_SIZE_MAX) {
+    if (tcache && tcache->node == (unsigned)node)
+      block = malloc_small(size_to_class(size), size);
+    else
+      block = malloc_node_small(size_to_class(size), size, (unsigned)node);
+    profile_alloc(block, size);
+    trace_alloc(TRACE_MALLOC_A, block, 0, size);
+    return block;
+  }
+
+  if (size > SIZE_MAX - _Alignof(max_align_t) + 1)
+    return NULL;
+
+  aligned_size =
+      (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+
+  if (aligned_size > mmap_threshold) {
+    block = malloc_large(aligned_size, _Alignof(max_align_t), (unsigned)node);
+    if (!block)
+      return NULL;
+    header = (header_t *)block - 1;
+  } else {
+    /* With a single node, the shared pool's chunks are on it already */
+    blocks = numa_nodes > 1 ? node_blocks((unsigned)node) : SHARED_BLOCKS;
+
+    malloc_lock();
+    header = get_free_block(blocks, aligned_size);
+    if (!header)
+      header = map_block(blocks, aligned_size);
+    malloc_unlock();
+
+    if (!header)
+      return NULL;
+    block = header + 1;
+  }
+
+  STAT_ADD(malloc_count, 1);
+  STAT_ADD(bytes_allocated, block_size(header));
+  profile_alloc(block, size);
+  trace_alloc(TRACE_MALLOC_A, block, 0, size);
+  return block;
+}
+
+/*
+ * @brief Body of free_a(), timed by it under ALLOCATOR_TIMING
+ */
+__attribute__((always_inline)) static inline void free_untimed(void *block) {
+  header_t *header;
+  chunk_t *chunk;
+
+  if (!block)
+    return;
+
+  profile_free(block);
+
+  /* Small objects of other threads' heaps and blocks are freed without a
+   * heap of our own, should none be available */
+  if (__builtin_expect(!tcache, 0))
+    tcache_register();
+
+  STAT_ADD(free_count, 1);
+
+  chunk = block_chunk(block);
+  if (chunk->s.kind == CHUNK_SLABS) {
+    slab_t *slab = slab_of(block);
+
+    STAT_ADD(bytes_freed, class_sizes[slab->cls]);
+    free_small(slab, block);
+    return;
+  }
+
+  header = (header_t *)block - 1;
+  STAT_ADD(bytes_freed, block_size(header));
+
+  if (chunk->s.kind == CHUNK_LARGE) {
+    free_large(header);
+    return;
+  }
+
+  malloc_lock();
+  free_block(header);
+  malloc_unlock();
+}
+
+/*
+ * @brief free_a() without tracing, for the entry points built on it
+ */
+__attribute__((always_inline)) static inline void free_untraced(void *block) {
+#ifdef ALLOCATOR_TIMING
+  unsigned op = timing_op;
+  uint64_t start;
+
+  timing_op = LOCK_OP_FREE_A;
+  start = timing_now();
+  free_untimed(block);
+  TIMING_RECORD(free_ns, timing_now() - start);
+  timing_op = op;
+#else
+  free_untimed(block);
+#endif
+}
+
+void free_a(void *block) {
+  trace_free(TRACE_FREE_A, block, 0);
+  free_untraced(block);
+}
+
+void free_sized_a(void *block, size_t size) {
+  if (!block)
+    return;
+
+  trace_free(TRACE_FREE_SIZED_A, block, size);
+
+  /* Objects of a class also serve smaller and over-aligned requests, so the
+   * size only bounds the class or block the object was served from */
+  assert(size && size <= malloc_usable_size_a(block) &&
+         "free_sized_a: size does not match the block");
+  free_untraced(block);
+}
+
+size_t malloc_usable_size_a(void *block) {
+  if (!block)
+    return 0;
+
+  if (block_chunk(block)->s.kind == CHUNK_SLABS)
+    return class_sizes[slab_of(block)->cls];
+  return block_size((header_t *)block - 1);
+}
+
+size_t good_size_a(size_t size) {
+  size_t aligned_size, map_size;
+
+  if (!size)
+    return 0;
+  if (size <= SMALL_SIZE_MAX)
+    return class_sizes[size_to_class(size)];
+
+  if (size > SIZE_MAX - _Alignof(max_align_t) + 1)
+    return 0;
+  aligned_size =
+      (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+  if (aligned_size > SIZE_MAX - sizeof(header_t))
+    return 0;
+  if (aligned_size <= mmap_threshold)
+    return aligned_size;
+
+  /* A large block gets the rest of its mapping's last page */
+  map_size = large_map_size(aligned_size, LARGE_OFFSET);
+  return map_size ? map_size - LARGE_OFFSET : 0;
+}
+
+/*
+ * @brief Fills a batch with small objects of one size class. The lock is
+ * only taken, once, when the heap's slabs run out.
+ *
+ * @return Number of objects stored in out
+ */
+static size_t malloc_batch_small(unsigned cls, size_t n, void **out) {
+  slab_t *slab;
+  size_t i = 0;
+
+  while (i < n && (slab = tcache->slabs[cls]))
+    out[i++] = slab_alloc(slab);
+
+  if (i < n) {
+    malloc_lock();
+    heap_drain(tcache, 1);
+    while (i < n && ((slab = tcache->slabs[cls]) ||
+                     (slab = slab_assign(tcache, cls))))
+      out[i++] = slab_alloc(slab);
+    malloc_unlock();
+  }
+
+  return i;
+}
+
+/*
+ * @brief Fills a batch with large blocks. Every block is mapped outside the
+ * lock, and the lock is taken once to link them all.
+ *
+ * @return Number of blocks stored in out
+ */
+static size_t malloc_batch_large(size_t size, size_t n, void **out) {
+  size_t map_size = large_map_size(size, LARGE_OFFSET);
+  size_t i;
+
+  if (!map_size)
+    return 0;
+
+  for (i = 0; i < n; i++) {
+    chunk_t *chunk = (chunk_t *)map_aligned(map_size);
+
+    if (!chunk)
+      break;
+    init_large_chunk(chunk, ANY_NODE);
+    set_large_size(chunk, (header_t *)(chunk + 1), map_size);
+    out[i] = (header_t *)(chunk + 1) + 1;
+  }
+
+  malloc_lock();
+  for (size_t j = 0; j < i; j++) {
+    link_chunk(chunk_of(out[j]));
+    stat_requested += size;
+    stat_handed_out += ((header_t *)out[j] - 1)->s.size;
+    stat_mapped += map_size;
+  }
+  malloc_unlock();
+
+  return i;
+}
+
+size_t malloc_batch_a(size_t size, size_t n, void **out) {
+  size_t aligned_size, block_bytes, i = 0;
+
+  if (!size || !n)
+    return 0;
+
+  if (__builtin_expect(!tcache, 0))
+    tcache_register();
+
+  if (size <= SMALL_SIZE_MAX && tcache) {
+    unsigned cls = size_to_class(size);
+
+    i = malloc_batch_small(cls, n, out);
+    STAT_ADD(malloc_count, i);
+    STAT_ADD(bytes_allocated, i * class_sizes[cls]);
+    STAT_ADD(small_requested, i * size);
+    STAT_ADD(small_handed_out, i * class_sizes[cls]);
+    for (size_t j = 0; j < i; j++) {
+      profile_alloc(out[j], size);
+      trace_alloc(TRACE_MALLOC_A, out[j], 0, size);
+    }
+    return i;
+  }
+
+  if (size > SIZE_MAX - _Alignof(max_align_t) + 1)
+    return 0;
+
+  aligned_size =
+      (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+
+  if (aligned_size > SIZE_MAX - sizeof(header_t))
+    return 0;
+
+  if (aligned_size > mmap_threshold) {
+    i = malloc_batch_large(aligned_size, n, out);
+  } else {
+    /* Blocks carved off the current chunk are contiguous */
+    malloc_lock();
+    for (; i < n; i++) {
+      header_t *header = get_free_block(SHARED_BLOCKS, aligned_size);
+
+      if (!header)
+        header = map_block(SHARED_BLOCKS, aligned_size);
+      if (!header)
+        break;
+      out[i] = header + 1;
+    }
+    malloc_unlock();
+  }
+
+  block_bytes = 0;
+  for (size_t j = 0; j < i; j++) {
+    block_bytes += block_size((header_t *)out[j] - 1);
+    profile_alloc(out[j], size);
+    trace_alloc(TRACE_MALLOC_A, out[j], 0, size);
+  }
+  STAT_ADD(malloc_count, i);
+  STAT_ADD(bytes_allocated, block_bytes);
+  return i;
+}
+
+void free_batch_a(void **ptrs, size_t n) {
+  chunk_t *unmap_list = NULL;
+  size_t freed = 0, bytes = 0;
+  int locked = 0;
+
+  if (__builtin_expect(!tcache, 0))
+    tcache_register();
+
+  /* Recorded up front, as the global lock may be held below */
+  for (size_t i = 0; i < n; i++)
+    trace_free(TRACE_FREE_A, ptrs[i], 0);
+
+  /* The lock is taken by the first free that needs it and kept from there */
+  for (size_t i = 0; i < n; i++) {
+    void *block = ptrs[i];
+    chunk_t *chunk;
+
+    if (!block)
+      continue;
+
+    profile_free(block);
+    freed++;
+    chunk = block_chunk(block);
+    if (chunk->s.kind == CHUNK_SLABS) {
+      slab_t *slab = slab_of(block);
+
+      bytes += class_sizes[slab->cls];
+      if (slab->owner != tcache) {
+        remote_free(slab->owner, block);
+      } else if (slab_free(block)) {
+        if (!locked++)
+          malloc_lock();
+        slab_retire(slab);
+      }
+      continue;
+    }
+
+    bytes += block_size((header_t *)block - 1);
+    if (!locked++)
+      malloc_lock();
+
+    if (chunk->s.kind == CHUNK_LARGE) {
+      /* Unlinked chunks are chained through their own links and unmapped
+       * after the lock is released */
+      unlink_chunk(chunk);
+      stat_mapped -= chunk->s.size;
+      chunk->s.next = unmap_list;
+      unmap_list = chunk;
+    } else {
+      free_block((header_t *)block - 1);
+    }
+  }
+
+  if (locked)
+    malloc_unlock();
+
+  while (unmap_list) {
+    chunk_t *next = unmap_list->s.next;
+
+    munmap(unmap_list, unmap_list->s.size);
+    SYSCALL_STAT(stat_munmaps);
+    unmap_list = next;
+  }
+
+  STAT_ADD(free_count, freed);
+  STAT_ADD(bytes_freed, bytes);
+}
+
+/*
+ * @brief Forgets the slabs, remote frees and magazines of a heap whose
+ * chunks are gone
+ */
+static void heap_reset(tcache_t *heap) {
+  heap->remote = NULL;
+  memset(heap->slabs, 0, sizeof(heap->slabs));
+  memset(heap->counts, 0, sizeof(heap->counts));
+  if (heap->mags)
+    memset(heap->mags, 0, heap->mag_count * sizeof(magazine_t));
+}
+
+/*
+ * @brief Prints the blocks still allocated at program exit to stderr. The
+ * exiting thread's heap and abandoned heaps are drained first, so objects
+ * freed to them count as freed; objects waiting on the remote lists of
+ * threads still running count as leaked. Arena and pool memory is not
+ * reported.
+ */
+static void report_leaks(void) {
+  size_t small_count = 0, small_bytes = 0;
+  size_t block_count = 0, block_bytes = 0;
+  size_t large_count = 0, large_bytes = 0;
+
+  malloc_lock();
+  if (tcache)
+    heap_drain(tcache, 1);
+  for (tcache_t *heap = abandoned_heaps; heap; heap = heap->next)
+    heap_drain(heap, 1);
+
+  for (chunk_t *chunk = chunk_list; chunk; chunk = chunk->s.next) {
+    if (chunk->s.kind == CHUNK_SLABS) {
+      slab_t *slabs = chunk_slabs(chunk);
+
+      for (unsigned i = 0; i < SLABS_PER_CHUNK; i++) {
+        if (slabs[i].cls == NO_CLASS)
+          continue;
+        small_count += slabs[i].used;
+        small_bytes += slabs[i].used * class_sizes[slabs[i].cls];
+      }
+    } else if (chunk->s.kind == CHUNK_LARGE) {
+      large_count++;
+      large_bytes += chunk->s.size;
+    } else if (chunk->s.kind == CHUNK_BLOCKS &&
+               chunk->s.top > (char *)(chunk + 1)) {
+      for (header_t *header = (header_t *)(chunk + 1); header;
+           header = next_block(header)) {
+        if (header->s.size & BLOCK_FREE)
+          continue;
+        block_count++;
+        block_bytes += block_size(header);
+      }
+    }
+  }
+  malloc_unlock();
+
+  /* Printed without the lock, as stdio may allocate */
+  if (!small_count && !block_count && !large_count)
+    return;
+  fprintf(stderr,
+          "allocator: %zu bytes in %zu blocks not freed at exit\n"
+          "  small objects   %zu bytes in %zu objects\n"
+          "  blocks          %zu bytes in %zu blocks\n"
+          "  large blocks    %zu bytes mapped for %zu blocks\n",
+          small_bytes + block_bytes + large_bytes,
+          small_count + block_count + large_count, small_bytes, small_count,
+          block_bytes, block_count, large_bytes, large_count);
+}
+
+/*
+ * @brief Runs at program exit. Depending on exit_cleanup, reports the leaked
+ * blocks, or frees all remaining allocated memory in time linear in the
+ * number of chunks by unmapping every chunk, leaving the allocator empty.
+ * Other threads' heaps, the pools and their magazines still point into the
+ * unmapped chunks, so nothing may allocate or free after a full cleanup.
+ */
+static void cleanup_untimed(void) {
+  trace_stop_a();
+  if (exit_cleanup == EXIT_LEAK_REPORT_A)
+    report_leaks();
+  if (exit_cleanup != EXIT_CLEANUP_FULL_A)
+    return;
+
+  malloc_lock();
+
+  while (chunk_list)
+    unmap_chunk(chunk_list);
+  release_large_cache();
+
+  memset(block_pools, 0, sizeof(block_pools));
+  stat_free = 0;
+
+  memset(empty_slabs, 0, sizeof(empty_slabs));
+
+  /* The slabs of the exiting thread's heap and of abandoned heaps were
+   * unmapped above */
+  if (tcache)
+    heap_reset(tcache);
+  for (tcache_t *heap = abandoned_heaps; heap; heap = heap->next)
+    heap_reset(heap);
+  for (unsigned node = 0; node < numa_nodes; node++)
+    if (node_heaps[node])
+      heap_reset(node_heaps[node]);
+
+  malloc_unlock();
+}
+
+/*
+ * @brief Exit handler running cleanup_untimed(), whose lock holds count as
+ * LOCK_OP_CLEANUP_A under ALLOCATOR_TIMING
+ */
+static void cleanup_a(void) {
+#ifdef ALLOCATOR_TIMING
+  unsigned op = timing_op;
+
+  timing_op = LOCK_OP_CLEANUP_A;
+  cleanup_untimed();
+  timing_op = op;
+#else
+  cleanup_untimed();
+#endif
+}
+
+/*
+ * Manual declaration of the standard library atexit() function to avoid
+ * including <stdlib.h>. The extern "C" guards ensure proper C linkage
+ * when this header is included from C++ source files.
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int atexit(void (*func)(void));
+
+#ifdef __cplusplus
+}
+#endif
+
+/*
+ * @brief fork() handlers. Every allocator lock is held across fork, in lock
+ * order, so the child never inherits one locked by a thread that does not
+ * exist in the child. The child then re-initializes the locks and drops
+ * the heaps of all threads but the forking one. Those threads may have been
+ * in the middle of a lockless slab, remote free or magazine update, so their
+ * heaps are leaked rather than handed to a new thread; only their counters
+ * are kept.
+ */
+static void prefork_a(void) {
+  pthread_mutex_lock(&pool_list_lock);
+  for (struct pool *pool = pool_list; pool; pool = pool->next)
+    lock_acquire(&pool->lock);
+  for (unsigned node = 0; node < numa_nodes; node++)
+    lock_acquire(&node_heap_locks[node]);
+  lock_acquire(&global_malloc_lock);
+  pthread_mutex_lock(&profile_lock);
+  pthread_mutex_lock(&trace_lock);
+}
+
+static void postfork_parent_a(void) {
+  pthread_mutex_unlock(&trace_lock);
+  pthread_mutex_unlock(&profile_lock);
+  lock_release(&global_malloc_lock);
+  for (unsigned node = 0; node < numa_nodes; node++)
+    lock_release(&node_heap_locks[node]);
+  for (struct pool *pool = pool_list; pool; pool = pool->next)
+    lock_release(&pool->lock);
+  pthread_mutex_unlock(&pool_list_lock);
+}
+
+static void postfork_child_a(void) {
+  tcache_t *heap, *next;
+
+  /* The child does not write to its parent's trace, whose unwritten events
+   * the parent still has */
+  trace_active = 0;
+  trace_fd = -1;
+  for (trace_buffer_t *buffer = trace_buffers; buffer; buffer = buffer->next) {
+    lock_init(&buffer->lock);
+    buffer->owned = buffer == trace_buffer;
+    buffer->length = 2 * sizeof(uint32_t);
+    buffer->last_seq = 0;
+    buffer->last_block = 0;
+  }
+  pthread_mutex_init(&trace_lock, NULL);
+  pthread_mutex_init(&profile_lock, NULL);
+  lock_init(&global_malloc_lock);
+  for (unsigned node = 0; node < numa_nodes; node++)
+    lock_init(&node_heap_locks[node]);
+  for (struct pool *pool = pool_list; pool; pool = pool->next)
+    lock_init(&pool->lock);
+  pthread_mutex_init(&pool_list_lock, NULL);
+
+  for (heap = tcache_list; heap; heap = next) {
+    next = heap->next;
+    if (heap != tcache)
+      add_thread_stats(&retired_stats, &heap->stats);
+  }
+  tcache_list = tcache;
+  if (tcache)
+    tcache->prev = tcache->next = NULL;
+}
+
+/*
+ * @brief Returns the number of NUMA nodes, from the highest node the kernel
+ * lists as possible
+ */
+static unsigned count_numa_nodes(void) {
+  int fd = open("/sys/devices/system/node/possible", O_RDONLY | O_CLOEXEC);
+  unsigned last = 0;
+  char buf[64];
+  ssize_t len;
+
+  if (fd < 0)
+    return 1;
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return 1;
+
+  /* The list looks like "0" or "0-3", the last number is the highest */
+  for (ssize_t i = 0; i < len; i++) {
+    if (buf[i] < '0' || buf[i] > '9')
+      continue;
+    last = 0;
+    while (i < len && buf[i] >= '0' && buf[i] <= '9')
+      last = last * 10 + (unsigned)(buf[i++] - '0');
+  }
+
+  return last < MAX_NUMA_NODES ? last + 1 : MAX_NUMA_NODES;
+}
+
+/*
+ * @brief Initializer function that finds the NUMA nodes and registers
+ * cleanup and the fork handlers at program start
+ */
+__attribute__((constructor)) void init_a(void) {
+  for (unsigned node = 0; node < MAX_NUMA_NODES; node++)
+    lock_init(&node_heap_locks[node]);
+  numa_nodes = count_numa_nodes();
+
+  atexit(cleanup_a);
+  pthread_atfork(prefork_a, postfork_parent_a, postfork_child_a);
+}
+
+int trim_a(void) {
+  int released;
+
+  malloc_lock();
+  if (tcache)
+    heap_collect(tcache);
+  for (tcache_t *heap = abandoned_heaps; heap; heap = heap->next)
+    heap_collect(heap);
+  released = release_free_pages(0);
+  malloc_unlock();
+
+  return released;
+}
+
+void stats_a(alloc_stats_t *stats) {
+  thread_stats_t sum;
+  size_t bytes_allocated, bytes_freed;
+
+  memset(stats, 0, sizeof(*stats));
+
+  malloc_lock();
+  stats->bytes_requested = stat_requested;
+  stats->bytes_handed_out = stat_handed_out;
+  stats->bytes_mapped = stat_mapped;
+  stats->bytes_free = stat_free;
+  stats->hugetlb_chunks = stat_hugetlb_chunks;
+  stats->thp_chunks = stat_thp_chunks;
+  stats->hugetlb_fallbacks = stat_hugetlb_fallbacks;
+
+  for (unsigned i = 0; i <= numa_nodes; i++) {
+    for (unsigned bin = 0; bin < NUM_FREE_BINS; bin++) {
+      if (bin < NUM_SIZE_CLASSES)
+        stats->free_blocks[bin] += block_pools[i].bin_counts[bin];
+      else
+        stats->free_blocks_large += block_pools[i].bin_counts[bin];
+    }
+  }
+
+  sum = retired_stats;
+  for (tcache_t *tc = tcache_list; tc; tc = tc->next) {
+    add_thread_stats(&sum, &tc->stats);
+
+    for (unsigned cls = 0; cls < NUM_SIZE_CLASSES; cls++)
+      stats->cached_blocks[cls] +=
+          __atomic_load_n(&tc->counts[cls], __ATOMIC_RELAXED);
+    stats->threads++;
+  }
+  for (tcache_t *tc = abandoned_heaps; tc; tc = tc->next)
+    for (unsigned cls = 0; cls < NUM_SIZE_CLASSES; cls++)
+      stats->cached_blocks[cls] += tc->counts[cls];
+  for (unsigned node = 0; node < numa_nodes; node++)
+    for (unsigned cls = 0; node_heaps[node] && cls < NUM_SIZE_CLASSES; cls++)
+      stats->cached_blocks[cls] +=
+          __atomic_load_n(&node_heaps[node]->counts[cls], __ATOMIC_RELAXED);
+  malloc_unlock();
+
+  stats->bytes_requested += sum.small_requested;
+  stats->bytes_handed_out += sum.small_handed_out;
+
+  /* Counters of different threads are read at slightly different times */
+  bytes_allocated = sum.bytes_allocated;
+  bytes_freed = sum.bytes_freed;
+  stats->bytes_in_use =
+      bytes_allocated > bytes_freed ? bytes_allocated - bytes_freed : 0;
+  stats->malloc_count = sum.malloc_count;
+  stats->free_count = sum.free_count;
+  stats->lock_acquisitions = sum.lock_acquisitions;
+  stats->lock_contentions = sum.lock_contentions;
+#ifdef ALLOCATOR_TIMING
+  memcpy(stats->lock_wait_ns, sum.lock_wait_ns, sizeof(sum.lock_wait_ns));
+  memcpy(stats->lock_hold_ns, sum.lock_hold_ns, sizeof(sum.lock_hold_ns));
+  memcpy(stats->malloc_ns, sum.malloc_ns, sizeof(sum.malloc_ns));
+  memcpy(stats->free_ns, sum.free_ns, sizeof(sum.free_ns));
+  memcpy(stats->lock_hold_op_ns, sum.lock_hold_op_ns,
+         sizeof(sum.lock_hold_op_ns));
+#endif
+
+  stats->mmap_count = __atomic_load_n(&stat_mmaps, __ATOMIC_RELAXED);
+  stats->munmap_count = __atomic_load_n(&stat_munmaps, __ATOMIC_RELAXED);
+  stats->mremap_count = __atomic_load_n(&stat_mremaps, __ATOMIC_RELAXED);
+  stats->madvise_count = __atomic_load_n(&stat_madvises, __ATOMIC_RELAXED);
+
+  for (unsigned cls = 0; cls < NUM_SIZE_CLASSES; cls++) {
+    stats->class_sizes[cls] = class_sizes[cls];
+    stats->bytes_cached += stats->cached_blocks[cls] * class_sizes[cls];
+  }
+
+  stats->internal_fragmentation =
+      stats->bytes_handed_out
+          ? 1.0 - (double)stats->bytes_requested /
+                      (double)stats->bytes_handed_out
+          : 0.0;
+  stats->external_fragmentation =
+      stats->bytes_mapped && stats->bytes_in_use < stats->bytes_mapped
+          ? 1.0 - (double)stats->bytes_in_use / (double)stats->bytes_mapped
+          : 0.0;
+}
+
+#ifdef ALLOCATOR_TIMING
+/*
+ * @brief Prints the median, 99th percentile and maximum of a timing
+ * histogram, each as the upper bound of its bucket
+ */
+static void print_timing(const char *name, const size_t *hist) {
+  size_t total = 0, seen = 0;
+  unsigned p50 = 0, p99 = 0, max = 0;
+
+  for (unsigned i = 0; i < TIMING_BUCKETS_A; i++)
+    total += hist[i];
+  for (unsigned i = 0; i < TIMING_BUCKETS_A; i++) {
+    if (!hist[i])
+      continue;
+    if (seen < (total + 1) / 2 && seen + hist[i] >= (total + 1) / 2)
+      p50 = i;
+    if (seen < total - total / 100 && seen + hist[i] >= total - total / 100)
+      p99 = i;
+    seen += hist[i];
+    max = i;
+  }
+
+  fprintf(stderr, "  %-15s %zu, p50 < %llu ns, p99 < %llu ns, max < %llu ns\n",
+          name, total, 2ULL << p50, 2ULL << p99, 2ULL << max);
+}
+#endif
+
+void malloc_stats_a(void) {
+  alloc_stats_t stats;
+
+  stats_a(&stats);
+
+  fprintf(stderr,
+          "allocator stats:\n"
+          "  mapped          %zu bytes\n"
+          "  in use          %zu bytes in %zu blocks\n"
+          "  free lists      %zu bytes\n"
+          "  thread caches   %zu bytes in %zu threads\n"
+          "  fragmentation   %.2f%% internal, %.2f%% external\n"
+          "  calls           %zu malloc, %zu free\n"
+          "  syscalls        %zu mmap, %zu munmap, %zu mremap, %zu madvise\n"
+          "  lock            %zu acquisitions, %zu contended\n"
+          "  huge pages      %zu hugetlb chunks, %zu thp chunks, %zu "
+          "fallbacks\n",
+          stats.bytes_mapped, stats.bytes_in_use,
+          stats.malloc_count - stats.free_count, stats.bytes_free,
+          stats.bytes_cached, stats.threads,
+          stats.internal_fragmentation * 100.0,
+          stats.external_fragmentation * 100.0, stats.malloc_count,
+          stats.free_count, stats.mmap_count, stats.munmap_count,
+          stats.mremap_count, stats.madvise_count, stats.lock_acquisitions,
+          stats.lock_contentions, stats.hugetlb_chunks, stats.thp_chunks,
+          stats.hugetlb_fallbacks);
+
+#ifdef ALLOCATOR_TIMING
+  print_timing("lock waits", stats.lock_wait_ns);
+  print_timing("lock holds", stats.lock_hold_ns);
+  print_timing(" in malloc_a", stats.lock_hold_op_ns[LOCK_OP_MALLOC_A]);
+  print_timing(" in free_a", stats.lock_hold_op_ns[LOCK_OP_FREE_A]);
+  print_timing(" at exit", stats.lock_hold_op_ns[LOCK_OP_CLEANUP_A]);
+  print_timing(" elsewhere", stats.lock_hold_op_ns[LOCK_OP_OTHER_A]);
+  print_timing("malloc_a calls", stats.malloc_ns);
+  print_timing("free_a calls", stats.free_ns);
+#endif
+
+  fprintf(stderr, "  %10s %12s %12s\n", "class", "free blocks", "cached");
+  for (unsigned cls = 0; cls < SIZE_CLASSES_A; cls++)
+    fprintf(stderr, "  %10zu %12zu %12zu\n", stats.class_sizes[cls],
+            stats.free_blocks[cls], stats.cached_blocks[cls]);
+  fprintf(stderr, "  %10s %12zu\n", "larger", stats.free_blocks_large);
+}
+
+/*
+ * @brief Tells whether an address is inside a chunk of the allocator
+ */
+static int is_chunk_memory(uintptr_t addr) {
+  int found = 0;
+
+  malloc_lock();
+  for (chunk_t *chunk = chunk_list; chunk && !found; chunk = chunk->s.next)
+    found = addr >= (uintptr_t)chunk && addr - (uintptr_t)chunk < chunk->s.size;
+  malloc_unlock();
+
+  return found;
+}
+
+size_t huge_pages_a(void) {
+  unsigned long start = 0, lo, hi;
+  char line[256];
+  size_t pages, kb;
+  FILE *smaps;
+
+  malloc_lock();
+  pages = 0;
+  for (chunk_t *chunk = chunk_list; chunk; chunk = chunk->s.next)
+    if (chunk->s.huge == CHUNK_HUGETLB)
+      pages += chunk->s.size / HUGE_PAGE_SIZE;
+  malloc_unlock();
+
+  /* Transparent huge pages are only known to the kernel. The file is read
+   * without the lock, as stdio may allocate. */
+  smaps = fopen("/proc/self/smaps", "r");
+  if (!smaps)
+    return pages;
+
+  while (fgets(line, sizeof(line), smaps)) {
+    /* A mapping starts with its address range */
+    if (sscanf(line, "%lx-%lx ", &lo, &hi) == 2) {
+      start = lo;
+      continue;
+    }
+    if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1 && kb &&
+        is_chunk_memory(start))
+      pages += kb * 1024 / HUGE_PAGE_SIZE;
+  }
+  fclose(smaps);
+
+  return pages;
+}
+
+int mallopt_a(int param, size_t value) {
+  int ret = 1;
+
+  /* backtrace() may allocate, so the profiler is set up without the lock */
+  if (param == M_PROFILE_A || param == M_PROFILE_SIGNAL_A)
+    return profile_config(param, value);
+
+  malloc_lock();
+  switch (param) {
+  case M_TRIM_THRESHOLD_A:
+    trim_threshold = value;
+    break;
+  case M_TRIM_DELAY_A:
+    trim_delay_ms = value;
+    break;
+  case M_UNMAP_EMPTY_A:
+    unmap_empty_chunks = value != 0;
+    break;
+  case M_HUGEPAGES_A:
+    if (value > HUGEPAGES_HUGETLB_A)
+      ret = 0;
+    else
+      huge_pages = (int)value;
+    break;
+  case M_EXIT_CLEANUP_A:
+    if (value > EXIT_LEAK_REPORT_A)
+      ret = 0;
+    else
+      exit_cleanup = (int)value;
+    break;
+  case M_SPLIT_MIN_A:
+    if (value < FREE_BLOCK_MIN)
+      ret = 0;
+    else
+      split_min = value;
+    break;
+  case M_PLACEMENT_A:
+    if (value > PLACEMENT_GOOD_FIT_A)
+      ret = 0;
+    else
+      placement = (int)value;
+    break;
+  case M_MMAP_THRESHOLD_A:
+    if (value > CHUNK_BLOCK_MAX)
+      ret = 0;
+    else
+      mmap_threshold = value;
+    break;
+  default:
+    ret = 0;
+  }
+  malloc_unlock();
+
+  return ret;
+}
+
+void *calloc_a(size_t num, size_t nsize) {
+  size_t size;
+  void *block;
+
+  if (!num || !nsize)
+    return NULL;
+
+  size = num * nsize;
+  if (nsize != size / num)
+    return NULL;
+
+  block = malloc_untraced(size);
+  if (!block)
+    return NULL;
+
+  memset(block, 0, size);
+  trace_alloc(TRACE_CALLOC_A, block, 0, size);
+
+  return block;
+}
+
+/*
+ * @brief Body of realloc_a() for a block and a nonzero size
+ */
+static void *realloc_untraced(void *block, size_t size) {
+  header_t *header;
+  chunk_t *chunk;
+  size_t old_size;
+  void *ret;
+
+  chunk = block_chunk(block);
+  header = (header_t *)block - 1;
+
+  /* An object that would change size class moves, as does a block shrunk to
+   * a small size, so that every small object is in the slab of the size
+   * class of its size */
+  if (chunk->s.kind == CHUNK_SLABS) {
+    unsigned cls = slab_of(block)->cls;
+
+    old_size = class_sizes[cls];
+    if (size <= old_size && size_to_class(size) == cls)
+      return block;
+  } else if (size <= SMALL_SIZE_MAX) {
+    old_size = block_size(header);
+  } else if (chunk->s.kind == CHUNK_LARGE) {
+    old_size = header->s.size;
+
+    ret = realloc_large(header, size);
+    if (ret) {
+      header = (header_t *)ret - 1;
+      if (header->s.size > old_size)
+        STAT_ADD(bytes_allocated, header->s.size - old_size);
+      else
+        STAT_ADD(bytes_freed, old_size - header->s.size);
+
+      /* Sampled like the new allocation realloc_a() stands for */
+      profile_free(block);
+      profile_alloc(ret, size);
+    }
+    return ret;
+  } else {
+    size_t aligned_size;
+    int resized;
+
+    if (size > SIZE_MAX - _Alignof(max_align_t) + 1)
+      return NULL;
+    aligned_size =
+        (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+
+    old_size = block_size(header);
+    if (old_size >= aligned_size &&
+        old_size - aligned_size < sizeof(header_t) + split_min)
+      return block;
+
+    /* A block grown past mmap_threshold moves to a chunk of its own */
+    if (size <= mmap_threshold) {
+      malloc_lock();
+      resized = resize_block(header, aligned_size);
+      malloc_unlock();
+
+      if (resized) {
+        if (block_size(header) > old_size)
+          STAT_ADD(bytes_allocated, block_size(header) - old_size);
+        else
+          STAT_ADD(bytes_freed, old_size - block_size(header));
+        profile_free(block);
+        profile_alloc(block, size);
+        return block;
+      }
+    }
+  }
+
+  ret = malloc_untraced(size);
+  if (ret) {
+    memcpy(ret, block, old_size < size ? old_size : size);
+    free_untraced(block);
+  }
+
+  return ret;
+}
+
+void *realloc_a(void *block, size_t size) {
+  void *ret;
+
+  if (!block)
+    return malloc_a(size);
+  if (!size) {
+    free_a(block);
+    return NULL;
+  }
+
+  ret = realloc_untraced(block, size);
+  trace_alloc(TRACE_REALLOC_A, ret, (uintptr_t)block, size);
+  return ret;
+}
+
+/*
+ * @brief Carves a block whose memory is aligned out of a free or new block
+ * padded by the alignment. The space before the aligned header becomes a
+ * free block of its own, and the excess after the block is split off like in
+ * get_free_block(). Caller must hold global_malloc_lock.
+ *
+ * @param aligned_size Size of the block in bytes excluding the header
+ * @param align Alignment, a power of two larger than _Alignof(max_align_t)
+ *
+ * @return Header of the block, or NULL if mmap failed
+ */
+static header_t *get_aligned_block(size_t aligned_size, size_t align) {
+  /* A leading free block needs room for its header, free list links and
+   * boundary tag, as does the block itself once freed */
+  size_t lead_min = sizeof(header_t) + FREE_BLOCK_MIN;
+  header_t *header, *aligned;
+  size_t handed_out, lead, padded;
+  uintptr_t mem;
+
+  if (aligned_size < FREE_BLOCK_MIN)
+    aligned_size = FREE_BLOCK_MIN;
+  padded = aligned_size + align + lead_min;
+
+  header = get_free_block(SHARED_BLOCKS, padded);
+  if (!header)
+    header = map_block(SHARED_BLOCKS, padded);
+  if (!header)
+    return NULL;
+  handed_out = header->s.size;
+
+  mem = ((uintptr_t)(header + 1) + align - 1) & ~(uintptr_t)(align - 1);
+  lead = mem - (uintptr_t)(header + 1);
+  if (lead && lead < lead_min) {
+    mem += align;
+    lead += align;
+  }
+
+  aligned = (header_t *)mem - 1;
+  if (lead) {
+    aligned->s.size = header->s.size - lead;
+    header->s.size = (lead - sizeof(header_t)) | BLOCK_FREE;
+    insert_free_block(header);
+  }
+
+  /* The leading block, now free, tagged the aligned block BLOCK_PREV_FREE */
+  if (block_size(aligned) - aligned_size >= sizeof(header_t) + split_min) {
+    header_t *rest = (header_t *)((char *)(aligned + 1) + aligned_size);
+
+    rest->s.size =
+        (block_size(aligned) - aligned_size - sizeof(header_t)) | BLOCK_FREE;
+    aligned->s.size = aligned_size | (aligned->s.size & BLOCK_PREV_FREE);
+    insert_free_block(rest);
+  }
+
+  stat_requested -= padded - aligned_size;
+  stat_handed_out -= handed_out - block_size(aligned);
+  return aligned;
+}
+
+/*
+ * @brief Returns the smallest size class that fits a request and whose
+ * objects are aligned as requested
+ *
+ * @return The size class, or NO_CLASS if no small class fits
+ */
+static unsigned aligned_class(size_t size, size_t align) {
+  if (size > SMALL_SIZE_MAX || align > SMALL_SIZE_MAX)
+    return NO_CLASS;
+
+  for (unsigned cls = size_to_class(size); cls < NUM_SIZE_CLASSES; cls++)
+    if (!(class_sizes[cls] & (align - 1)))
+      return cls;
+  return NO_CLASS;
+}
+
+void *aligned_alloc_a(size_t alignment, size_t size) {
+  size_t aligned_size;
+  header_t *header;
+  unsigned cls;
+  void *block;
+
+  if (!size || !alignment || (alignment & (alignment - 1)))
+    return NULL;
+
+  if (alignment <= _Alignof(max_align_t)) {
+    block = malloc_untraced(size);
+    trace_alloc(TRACE_ALIGNED_A, block, alignment, size);
+    return block;
+  }
+
+  if (__builtin_expect(!tcache, 0))
+    tcache_register();
+
+  cls = aligned_class(size, alignment);
+  if (cls != NO_CLASS && tcache) {
+    block = malloc_small(cls, size);
+    profile_alloc(block, size);
+    trace_alloc(TRACE_ALIGNED_A, block, alignment, size);
+    return block;
+  }
+
+  if (size > SIZE_MAX - CHUNK_SIZE)
+    return NULL;
+
+  aligned_size =
+      (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+
+  if (alignment > CHUNK_BLOCK_MAX ||
+      aligned_size + alignment + sizeof(header_t) + sizeof(free_links_t) >
+          mmap_threshold) {
+    block = malloc_large(aligned_size, alignment, ANY_NODE);
+    if (!block)
+      return NULL;
+    header = (header_t *)block - 1;
+  } else {
+    malloc_lock();
+    header = get_aligned_block(aligned_size, alignment);
+    malloc_unlock();
+
+    if (!header)
+      return NULL;
+  }
+
+  STAT_ADD(malloc_count, 1);
+  STAT_ADD(bytes_allocated, block_size(header));
+  profile_alloc(header + 1, size);
+  trace_alloc(TRACE_ALIGNED_A, header + 1, alignment, size);
+  return (void *)(header + 1);
+}
+
+int posix_memalign_a(void **memptr, size_t alignment, size_t size) {
+  void *block;
+
+  if (!alignment || (alignment & (alignment - 1)) ||
+      alignment % sizeof(void *))
+    return EINVAL;
+
+  if (!size) {
+    *memptr = NULL;
+    return 0;
+  }
+
+  block = aligned_alloc_a(alignment, size);
+  if (!block)
+    return ENOMEM;
+
+  *memptr = block;
+  return 0;
+}
+
+/*
+ * @union arena_chunk_t
+ * @brief Header following chunk_t in each chunk of an arena, linking the
+ * arena's chunks in the order they are filled. The arena itself is kept in
+ * its first chunk, right after this header.
+ *
+ * Structure of the first chunk:
+ *
+ *    +---------+---------------+-------+---------------+------------------+
+ *    | chunk_t | arena_chunk_t | arena | allocations   | unused           |
+ *    +---------+---------------+-------+---------------+------------------+
+ *
+ *                                                      ^
+ *                                                      |
+ *                                                      top
+ */
+typedef union arena_chunk {
+  struct {
+    /* Next chunk of the arena */
+    chunk_t *next;
+  } s;
+  ALIGN stub;
+} arena_chunk_t;
+
+struct arena {
+  /* First chunk of the arena and the chunk being filled */
+  chunk_t *first;
+  chunk_t *current;
+};
+
+_Static_assert(sizeof(struct arena) % _Alignof(max_align_t) == 0,
+               "arena_t must preserve allocation alignment");
+
+static inline arena_chunk_t *arena_link(chunk_t *chunk) {
+  return (arena_chunk_t *)(chunk + 1);
+}
+
+static inline char *arena_start(chunk_t *chunk) {
+  return (char *)(arena_link(chunk) + 1);
+}
+
+/*
+ * @brief Maps a chunk for an arena, larger than CHUNK_SIZE if needed
+ *
+ * @param size Bytes the chunk must have room for, besides its headers
+ *
+ * @return Pointer to the new chunk, or NULL on failure
+ */
+static chunk_t *map_arena_chunk(size_t size, unsigned node) {
+  size_t page = page_size();
+  size_t overhead =
+      sizeof(chunk_t) + sizeof(arena_chunk_t) + sizeof(struct arena);
+  size_t map_size = CHUNK_SIZE;
+  chunk_t *chunk;
+
+  if (size > CHUNK_SIZE - overhead) {
+    if (size > SIZE_MAX - overhead - page)
+      return NULL;
+    map_size = (size + overhead + page - 1) & ~(page - 1);
+  }
+
+  malloc_lock();
+  chunk = map_chunk(map_size, CHUNK_ARENA, node);
+  malloc_unlock();
+
+  if (chunk)
+    arena_link(chunk)->s.next = NULL;
+  return chunk;
+}
+
+/*
+ * @brief Moves an arena on to a chunk with room for a request: the chunk
+ * after the current one if arena_reset_a() kept one large enough, otherwise a
+ * new chunk inserted in front of it
+ *
+ * @return The arena's new current chunk, or NULL on failure
+ */
+static chunk_t *arena_next_chunk(arena_t *arena, size_t size) {
+  chunk_t *curr = arena->current;
+  chunk_t *next = arena_link(curr)->s.next;
+
+  if (!next ||
+      (size_t)((char *)next + next->s.size - arena_start(next)) < size) {
+    chunk_t *chunk = map_arena_chunk(size, arena->first->s.node);
+
+    if (!chunk)
+      return NULL;
+    arena_link(chunk)->s.next = next;
+    arena_link(curr)->s.next = chunk;
+    next = chunk;
+  }
+
+  next->s.top = arena_start(next);
+  arena->current = next;
+  return next;
+}
+
+arena_t *arena_create_a(void) {
+  /* All chunks of the arena are bound to the node of the creating thread */
+  chunk_t *chunk = map_arena_chunk(0, current_node());
+  arena_t *arena;
+
+  if (!chunk)
+    return NULL;
+
+  arena = (arena_t *)arena_start(chunk);
+  arena->first = chunk;
+  arena->current = chunk;
+  chunk->s.top = (char *)(arena + 1);
+
+  return arena;
+}
+
+void *arena_alloc_a(arena_t *arena, size_t size) {
+  chunk_t *chunk = arena->current;
+  size_t aligned_size;
+  char *block;
+
+  if (!size || size > SIZE_MAX - _Alignof(max_align_t) + 1)
+    return NULL;
+
+  aligned_size =
+      (size + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1);
+
+  if (aligned_size > (size_t)((char *)chunk + chunk->s.size - chunk->s.top)) {
+    chunk = arena_next_chunk(arena, aligned_size);
+    if (!chunk)
+      return NULL;
+  }
+
+  block = chunk->s.top;
+  chunk->s.top += aligned_size;
+  return block;
+}
+
+void arena_reset_a(arena_t *arena) {
+  arena->current = arena->first;
+  arena->first->s.top = (char *)(arena + 1);
+}
+
+void arena_destroy_a(arena_t *arena) {
+  chunk_t *chunk = arena->first;
+
+  malloc_lock();
+  while (chunk) {
+    chunk_t *next = arena_link(chunk)->s.next;
+    unmap_chunk(chunk);
+    chunk = next;
+  }
+  malloc_unlock();
+}
+
+/*
+ * @brief Returns the chunk a pool chunk after the first was started after.
+ * Those chunks keep the link right after their chunk_t, and the first chunk
+ * keeps the pool_t there instead.
+ */
+static inline chunk_t **pool_chunk_link(chunk_t *chunk) {
+  return (chunk_t **)(chunk + 1);
+}
+
+/*
+ * @brief Returns where the objects of a pool chunk start: on the first cache
+ * line from an address, or at the objects' larger alignment. Objects follow
+ * each other from there, obj_size apart.
+ */
+static inline char *pool_objects_start(char *from, size_t align) {
+  if (align < CACHE_LINE)
+    align = CACHE_LINE;
+  return (char *)(((uintptr_t)from + align - 1) & ~(uintptr_t)(align - 1));
+}
+
+pool_t *pool_create_a(size_t obj_size, size_t align) {
+  struct pool **link;
+  size_t size;
+  chunk_t *chunk;
+  pool_t *pool;
+
+  if (!align)
+    align = _Alignof(max_align_t);
+  if (!obj_size || (align & (align - 1)) || align > page_size())
+    return NULL;
+
+  size = obj_size < sizeof(void *) ? sizeof(void *) : obj_size;
+  if (size > CHUNK_BLOCK_MAX)
+    return NULL;
+  size = (size + align - 1) & ~(align - 1);
+
+  malloc_lock();
+  chunk = map_chunk(CHUNK_SIZE, CHUNK_POOL, ANY_NODE);
+  if (chunk)
+    chunk->s.top =
+        pool_objects_start((char *)(chunk + 1) + sizeof(pool_t), align);
+  malloc_unlock();
+
+  if (!chunk)
+    return NULL;
+
+  pool = (pool_t *)(chunk + 1);
+  lock_init(&pool->lock);
+  pool->free = NULL;
+  pool->chunk = chunk;
+  pool->obj_size = size;
+  pool->align = align;
+
+  /* Ids stay dense as pools come and go, which keeps the heaps' magazine
+   * arrays small */
+  pthread_mutex_lock(&pool_list_lock);
+  link = &pool_list;
+  pool->id = 0;
+  while (*link && (*link)->id == pool->id) {
+    link = &(*link)->next;
+    pool->id++;
+  }
+  pool->next = *link;
+  *link = pool;
+  pthread_mutex_unlock(&pool_list_lock);
+
+  return pool;
+}
+
+void pool_destroy_a(pool_t *pool) {
+  chunk_t *first = chunk_of(pool);
+  chunk_t *chunk = pool->chunk;
+  struct pool **link;
+
+  pthread_mutex_lock(&pool_list_lock);
+  for (link = &pool_list; *link != pool; link = &(*link)->next)
+    ;
+  *link = pool->next;
+  pthread_mutex_unlock(&pool_list_lock);
+
+  /* Magazines of every heap, including abandoned ones, forget the pool so
+   * that a pool taking over its id starts from empty magazines */
+  malloc_lock();
+  for (int abandoned = 0; abandoned < 2; abandoned++) {
+    for (tcache_t *heap = abandoned ? abandoned_heaps : tcache_list; heap;
+         heap = heap->next) {
+      if (pool->id < heap->mag_count && heap->mags[pool->id].pool == pool)
+        memset(&heap->mags[pool->id], 0, sizeof(magazine_t));
+    }
+  }
+
+  while (chunk != first) {
+    chunk_t *prev = *pool_chunk_link(chunk);
+
+    unmap_chunk(chunk);
+    chunk = prev;
+  }
+  unmap_chunk(first);
+  malloc_unlock();
+}
+
+/*
+ * @brief Grows the calling thread's magazine array to hold the magazine of a
+ * pool id. Arrays take whole pages and double in size.
+ *
+ * @return 0 on success, -1 if mmap failed
+ */
+static int magazines_grow(unsigned id) {
+  size_t size = page_size(), old_size;
+  magazine_t *mags, *old;
+
+  while (size / sizeof(magazine_t) <= id)
+    size *= 2;
+
+  mags = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+              -1, 0);
+  SYSCALL_STAT(stat_mmaps);
+  if (mags == MAP_FAILED)
+    return -1;
+
+  /* pool_destroy_a() clears magazines of other heaps under the lock */
+  malloc_lock();
+  old = tcache->mags;
+  old_size = tcache->mag_count * sizeof(magazine_t);
+  if (old)
+    memcpy(mags, old, old_size);
+  tcache->mags = mags;
+  tcache->mag_count = (unsigned)(size / sizeof(magazine_t));
+  malloc_unlock();
+
+  if (old) {
+    munmap(old, (old_size + page_size() - 1) & ~(page_size() - 1));
+    SYSCALL_STAT(stat_munmaps);
+  }
+  return 0;
+}
+
+/*
+ * @brief Returns the calling thread's magazine for a pool, growing its
+ * magazine array when the pool's id is beyond it
+ *
+ * @return The magazine, or NULL if the array could not grow
+ */
+static inline magazine_t *pool_magazine(pool_t *pool) {
+  if (__builtin_expect(pool->id >= tcache->mag_count, 0) &&
+      magazines_grow(pool->id))
+    return NULL;
+  return &tcache->mags[pool->id];
+}
+
+/*
+ * @brief Fills a thread's magazine for a pool. Objects given back to the pool
+ * come first; new ones are carved from the pool's chunk, starting a new chunk
+ * when it is exhausted.
+ *
+ * @return 0 on success, -1 if the pool has no objects left and no chunk
+ * could be mapped
+ */
+static int magazine_refill(pool_t *pool, magazine_t *mag) {
+  mag->pool = pool;
+
+  lock_acquire(&pool->lock);
+  while (pool->free && mag->count < POOL_MAG_BATCH) {
+    void *obj = pool->free;
+    pool->free = *(void **)obj;
+    *(void **)obj = mag->head;
+    mag->head = obj;
+    mag->count++;
+  }
+
+  while (mag->count < POOL_MAG_BATCH) {
+    chunk_t *chunk = pool->chunk;
+    char *obj = chunk->s.top;
+
+    if (obj + pool->obj_size > (char *)chunk + chunk->s.size) {
+      if (mag->count)
+        break;
+
+      malloc_lock();
+      chunk = map_chunk(CHUNK_SIZE, CHUNK_POOL, ANY_NODE);
+      malloc_unlock();
+      if (!chunk)
+        break;
+
+      *pool_chunk_link(chunk) = pool->chunk;
+      chunk->s.top =
+          pool_objects_start((char *)(pool_chunk_link(chunk) + 1), pool->align);
+      pool->chunk = chunk;
+      continue;
+    }
+
+    chunk->s.top = obj + pool->obj_size;
+    *(void **)obj = mag->head;
+    mag->head = obj;
+    mag->count++;
+  }
+  lock_release(&pool->lock);
+
+  return mag->count ? 0 : -1;
+}
+
+void *pool_alloc_a(pool_t *pool) {
+  magazine_t *mag;
+  void *obj;
+
+  if (__builtin_expect(!tcache, 0) && tcache_register())
+    return NULL;
+
+  mag = pool_magazine(pool);
+  if (!mag || (__builtin_expect(!mag->head, 0) && magazine_refill(pool, mag)))
+    return NULL;
+
+  obj = mag->head;
+  mag->head = *(void **)obj;
+  mag->count--;
+  return obj;
+}
+
+void pool_free_a(pool_t *pool, void *obj) {
+  magazine_t *mag;
+
+  if (!obj)
+    return;
+
+  if ((__builtin_expect(!tcache, 0) && tcache_register()) ||
+      !(mag = pool_magazine(pool))) {
+    lock_acquire(&pool->lock);
+    *(void **)obj = pool->free;
+    pool->free = obj;
+    lock_release(&pool->lock);
+    return;
+  }
+
+  if (__builtin_expect(!mag->pool, 0))
+    mag->pool = pool;
+
+  *(void **)obj = mag->head;
+  mag->head = obj;
+  if (__builtin_expect(++mag->count > POOL_MAG_MAX, 0)) {
+    lock_acquire(&pool->lock);
+    while (mag->count > POOL_MAG_MAX / 2) {
+      obj = mag->head;
+      mag->head = *(void **)obj;
+      *(void **)obj = pool->free;
+      pool->free = obj;
+      mag->count--;
+    }
+    lock_release(&pool->lock);
+  }
 }
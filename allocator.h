@@ -11,6 +11,10 @@
 
 #include <stddef.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /*
  * @brief Allocates a block of memory
  *
@@ -20,6 +24,24 @@
  */
 void *malloc_a(size_t size);
 
+/*
+ * @brief Allocates a block of memory on a NUMA node. Small requests come from
+ * slabs of the node, from the calling thread's heap when it runs on the node
+ * and from a shared heap of the node otherwise. Larger requests up to the
+ * M_MMAP_THRESHOLD_A size come from chunks bound to the node, whose freed
+ * blocks are only reused by requests for the same node, and the largest ones
+ * get a mapping of their own with the node as preferred node. Every thread's
+ * heap takes its slabs from the node the thread first allocated on, and
+ * arenas are placed on the node of the thread creating them.
+ *
+ * @param size Number of bytes to allocate
+ * @param node NUMA node, from 0 to the highest node of the machine
+ *
+ * @return Pointer to allocated memory on success, NULL on failure or if the
+ * node does not exist
+ */
+void *malloc_node_a(size_t size, int node);
+
 /*
  * @brief Explicitly free a previously allocated block of memory
  *
@@ -27,6 +49,43 @@ void *malloc_a(size_t size);
  */
 void free_a(void *block);
 
+/*
+ * @brief Frees a block whose size is known, like C23 free_sized(). The block
+ * is freed like by free_a(), which finds its slab or header either way;
+ * builds without NDEBUG check the size against the block.
+ *
+ * @param block Pointer to a memory block from malloc_a(), calloc_a(),
+ * realloc_a() or malloc_batch_a(), not from aligned_alloc_a()
+ * @param size Size last requested for the block, the product of the
+ * arguments for calloc_a()
+ */
+void free_sized_a(void *block, size_t size);
+
+/*
+ * @brief Returns the number of bytes usable in a block, at least the size
+ * requested for it
+ *
+ * @param block Pointer to a memory block, or NULL
+ *
+ * @return Usable size in bytes, 0 for NULL
+ */
+size_t malloc_usable_size_a(void *block);
+
+/*
+ * @brief Returns the size malloc_a() rounds a request up to: its size class,
+ * or the pages of a large block. A container can grow to this capacity for
+ * free, and malloc_a(good_size_a(size)) uses no more memory than
+ * malloc_a(size). malloc_usable_size_a() of the block is usually the same;
+ * it is larger when a free block too small to split is handed out whole, and
+ * can be smaller for a small request made without a thread heap, such as
+ * from a thread's destructors.
+ *
+ * @param size Requested size in bytes
+ *
+ * @return Rounded size in bytes, 0 for 0 or a size no block can hold
+ */
+size_t good_size_a(size_t size);
+
 /*
  * @brief Allocated and zero-initializes a block of memory
  *
@@ -48,4 +107,444 @@ void *calloc_a(size_t num, size_t nsize);
  */
 void *realloc_a(void *block, size_t size);
 
+/*
+ * @brief Allocates a block of memory aligned to a power of two. Small
+ * requests come from a size class whose objects are naturally aligned, and
+ * large ones from a mapping the block is placed at an aligned offset of, so
+ * no memory is wasted on padding. Alignments above 2 MiB place the block 4 MiB
+ * into a mapping of its own, whose skipped pages are never touched. The
+ * block is freed with free_a() and resized with realloc_a(), which does not
+ * preserve the alignment when it moves the block.
+ *
+ * @param alignment Alignment in bytes, a power of two
+ * @param size Number of bytes to allocate
+ *
+ * @return Pointer to allocated memory on success, NULL on failure or if the
+ * alignment is not a power of two
+ */
+void *aligned_alloc_a(size_t alignment, size_t size);
+
+/*
+ * @brief Allocates a block of memory aligned to a power of two, see
+ * aligned_alloc_a()
+ *
+ * @param memptr Receives the pointer to the allocated memory, NULL if size
+ * is 0
+ * @param alignment Alignment in bytes, a power of two multiple of
+ * sizeof(void *)
+ * @param size Number of bytes to allocate
+ *
+ * @return 0 on success, EINVAL if the alignment is not supported, ENOMEM if
+ * memory is exhausted
+ */
+int posix_memalign_a(void **memptr, size_t alignment, size_t size);
+
+/*
+ * @brief Allocates several blocks of the same size, taking the allocator's
+ * lock at most once
+ *
+ * @param size Number of bytes of each block
+ * @param n Number of blocks
+ * @param out Array receiving the pointers to the blocks
+ *
+ * @return Number of blocks allocated and stored in out, less than n only on
+ * failure
+ */
+size_t malloc_batch_a(size_t size, size_t n, void **out);
+
+/*
+ * @brief Frees several blocks, taking the allocator's lock at most once
+ *
+ * @param ptrs Pointers to the blocks to free, NULL entries are skipped
+ * @param n Number of pointers
+ */
+void free_batch_a(void **ptrs, size_t n);
+
+/*
+ * Parameters for mallopt_a()
+ *
+ * M_TRIM_THRESHOLD_A: free bytes that accumulate before an automatic trim pass
+ * runs, 0 disables automatic trimming
+ * M_TRIM_DELAY_A: milliseconds after which a trim pass runs even below the
+ * threshold. A pass gives back the pages of blocks that stayed free since the
+ * previous pass.
+ * M_UNMAP_EMPTY_A: nonzero unmaps a chunk as soon as all of it is free
+ * M_EXIT_CLEANUP_A: what happens at program exit, one of the EXIT_*_A values
+ * below
+ * M_HUGEPAGES_A: huge page backing of the chunks mapped from then on, one of
+ * the HUGEPAGES_*_A values below
+ * M_MMAP_THRESHOLD_A: requests above this many bytes, at most 2 MiB, are
+ * mapped directly and resized with mremap by realloc_a(). Up to 64 MiB of
+ * freed mappings are kept for the next such requests until a trim pass, and a
+ * request reusing one gets all of it.
+ * M_SPLIT_MIN_A: smallest remainder in bytes, at least 32, split off a free
+ * block that is reused for a smaller request
+ * M_PLACEMENT_A: placement policy for requests served from the shared free
+ * lists, one of the PLACEMENT_*_A values below
+ * M_PROFILE_A: mean number of bytes allocated between two allocations sampled
+ * by the heap profiler, see profile_dump_a(); 0, the default, disables it
+ * M_PROFILE_SIGNAL_A: signal on which the heap profile is written to
+ * heap.<pid>.<n>.prof in the working directory, 0 for none
+ */
+#define M_TRIM_THRESHOLD_A 1
+#define M_TRIM_DELAY_A 2
+#define M_UNMAP_EMPTY_A 3
+#define M_MMAP_THRESHOLD_A 4
+#define M_SPLIT_MIN_A 5
+#define M_PLACEMENT_A 6
+#define M_EXIT_CLEANUP_A 7
+#define M_HUGEPAGES_A 8
+#define M_PROFILE_A 9
+#define M_PROFILE_SIGNAL_A 10
+
+/*
+ * Placement policies for M_PLACEMENT_A
+ *
+ * PLACEMENT_FIRST_FIT_A: first fitting block of the smallest candidate size
+ * class, the default
+ * PLACEMENT_BEST_FIT_A: smallest fitting block, scanning whole size classes
+ * PLACEMENT_GOOD_FIT_A: any block of the next larger size class, constant time
+ */
+#define PLACEMENT_FIRST_FIT_A 0
+#define PLACEMENT_BEST_FIT_A 1
+#define PLACEMENT_GOOD_FIT_A 2
+
+/*
+ * Exit behaviours for M_EXIT_CLEANUP_A
+ *
+ * EXIT_CLEANUP_OFF_A: nothing, the OS reclaims the memory, the default. Exit
+ * handlers, destructors and other threads may keep allocating and freeing.
+ * EXIT_CLEANUP_FULL_A: all memory is unmapped chunk by chunk. Only for
+ * programs that neither allocate nor free once their exit handlers run and
+ * whose other threads have exited, as blocks and pools freed later point into
+ * unmapped memory.
+ * EXIT_LEAK_REPORT_A: the blocks not freed are summed up on stderr, and the
+ * memory is left to the OS
+ */
+#define EXIT_CLEANUP_OFF_A 0
+#define EXIT_CLEANUP_FULL_A 1
+#define EXIT_LEAK_REPORT_A 2
+
+/*
+ * Huge page policies for M_HUGEPAGES_A. Chunks are 4 MiB regions aligned to
+ * 4 MiB, so they hold whole 2 MiB huge pages. Large blocks are mapped with
+ * normal pages in any case.
+ *
+ * HUGEPAGES_OFF_A: normal pages, the default
+ * HUGEPAGES_THP_A: chunks are advised with madvise(MADV_HUGEPAGE), so the
+ * kernel backs them with transparent huge pages when it can
+ * HUGEPAGES_HUGETLB_A: chunks are mapped with MAP_HUGETLB from the reserved
+ * huge pages, falling back to HUGEPAGES_THP_A when none is left. Their pages
+ * are only given back to the OS when the whole chunk is unmapped.
+ */
+#define HUGEPAGES_OFF_A 0
+#define HUGEPAGES_THP_A 1
+#define HUGEPAGES_HUGETLB_A 2
+
+/*
+ * Number of small size classes reported by stats_a()
+ */
+#define SIZE_CLASSES_A 20
+
+/*
+ * Number of buckets of the timing histograms reported by stats_a()
+ */
+#define TIMING_BUCKETS_A 32
+
+/*
+ * Operations the lock hold histogram of stats_a() is split by
+ *
+ * LOCK_OP_OTHER_A: every other call, such as realloc_a() resizing a block,
+ * the batch calls, pools, arenas, trim_a() and stats_a()
+ * LOCK_OP_MALLOC_A: malloc_a(), including its calls from calloc_a() and
+ * realloc_a()
+ * LOCK_OP_FREE_A: free_a() and free_sized_a(), including the frees of
+ * realloc_a()
+ * LOCK_OP_CLEANUP_A: the exit handler, see M_EXIT_CLEANUP_A
+ */
+#define LOCK_OP_OTHER_A 0
+#define LOCK_OP_MALLOC_A 1
+#define LOCK_OP_FREE_A 2
+#define LOCK_OP_CLEANUP_A 3
+#define LOCK_OPS_A 4
+
+/*
+ * @struct alloc_stats_t
+ * @brief Allocator statistics, see stats_a()
+ */
+typedef struct alloc_stats {
+  /* Bytes requested from the shared pool since program start */
+  size_t bytes_requested;
+
+  /* Bytes of the blocks the shared pool handed out for those requests */
+  size_t bytes_handed_out;
+
+  /* Share of handed out bytes that were not requested, between 0 and 1 */
+  double internal_fragmentation;
+
+  /* Bytes currently mapped from the OS */
+  size_t bytes_mapped;
+
+  /* Bytes of the blocks on the shared free lists and of the empty slabs */
+  size_t bytes_free;
+
+  /* Bytes of the blocks allocated by the program and not freed yet */
+  size_t bytes_in_use;
+
+  /* Bytes of the free objects in slabs owned by thread heaps */
+  size_t bytes_cached;
+
+  /* Share of mapped bytes not in use by the program, between 0 and 1 */
+  double external_fragmentation;
+
+  /* Calls to malloc_a and free_a, including those made by calloc_a and
+   * realloc_a */
+  size_t malloc_count;
+  size_t free_count;
+
+  /* System calls made by the allocator */
+  size_t mmap_count;
+  size_t munmap_count;
+  size_t mremap_count;
+  size_t madvise_count;
+
+  /* Acquisitions of the allocator lock, and those that had to wait */
+  size_t lock_acquisitions;
+  size_t lock_contentions;
+
+  /* Histograms of the time spent waiting for and holding the allocator
+   * lock, and in malloc_a and free_a calls. Bucket i counts durations from
+   * 2^i up to 2^(i+1) nanoseconds, the last bucket all longer ones. Only
+   * filled in when the allocator is built with -DALLOCATOR_TIMING. */
+  size_t lock_wait_ns[TIMING_BUCKETS_A];
+  size_t lock_hold_ns[TIMING_BUCKETS_A];
+  size_t malloc_ns[TIMING_BUCKETS_A];
+  size_t free_ns[TIMING_BUCKETS_A];
+
+  /* The lock holds of lock_hold_ns split by the LOCK_OP_*_A operation that
+   * held the lock, so contention can be told apart by operation */
+  size_t lock_hold_op_ns[LOCK_OPS_A][TIMING_BUCKETS_A];
+
+  /* Threads with a live thread cache */
+  size_t threads;
+
+  /* Chunks mapped with MAP_HUGETLB and chunks advised with MADV_HUGEPAGE,
+   * and MAP_HUGETLB mappings that failed and fell back, see M_HUGEPAGES_A */
+  size_t hugetlb_chunks;
+  size_t thp_chunks;
+  size_t hugetlb_fallbacks;
+
+  /* Block size of each small size class */
+  size_t class_sizes[SIZE_CLASSES_A];
+
+  /* Blocks of each small size class on the shared free lists */
+  size_t free_blocks[SIZE_CLASSES_A];
+
+  /* Free objects of each small size class in slabs owned by thread heaps */
+  size_t cached_blocks[SIZE_CLASSES_A];
+
+  /* Blocks larger than the largest size class on the shared free lists */
+  size_t free_blocks_large;
+} alloc_stats_t;
+
+/*
+ * @brief Gives free memory back to the OS: unmaps fully free chunks and the
+ * cached mappings of freed large blocks, and releases the pages of free
+ * blocks with madvise(MADV_DONTNEED). The calling thread's cache is flushed
+ * first.
+ *
+ * @return 1 if any memory was released, 0 otherwise
+ */
+int trim_a(void);
+
+/*
+ * @brief Reports allocator statistics. Per-thread counters are summed up on
+ * each call, so this is meant for periodic sampling, not for hot paths.
+ *
+ * @param stats Filled in with the current statistics
+ */
+void stats_a(alloc_stats_t *stats);
+
+/*
+ * @brief Prints the statistics of stats_a() to stderr in a human readable form
+ */
+void malloc_stats_a(void);
+
+/*
+ * @brief Counts the huge pages actually backing the allocator's chunks. The
+ * transparent huge pages are read from /proc/self/smaps, so this is slow and
+ * meant for occasional checks.
+ *
+ * @return Number of 2 MiB pages
+ */
+size_t huge_pages_a(void);
+
+/*
+ * @brief Writes the heap profile gathered under M_PROFILE_A in the legacy
+ * text heap format of pprof: the sampled allocations not freed yet, grouped
+ * by call stack, followed by the process mappings. View it with
+ * pprof <program> <file>.
+ *
+ * @param fd File descriptor to write the profile to
+ *
+ * @return 0 on success, -1 if writing failed
+ */
+int profile_dump_a(int fd);
+
+/*
+ * Format of the allocation trace of trace_start_a()
+ *
+ * The file starts with the 8 bytes of TRACE_MAGIC_A, followed by blocks, each
+ * the events of one thread: a uint32_t thread number, a uint32_t byte count,
+ * and the events. An event is one byte TRACE_*_A, then LEB128 varints: the
+ * distance of its sequence number from the previous event of the block, and
+ * the fields listed below. Sequence numbers order the events of all threads.
+ * Block addresses are zigzag encoded differences from the previous address in
+ * the block.
+ *
+ * TRACE_MALLOC_A: size, block; also malloc_node_a() and malloc_batch_a()
+ * TRACE_CALLOC_A: size, block
+ * TRACE_ALIGNED_A: alignment, size, block
+ * TRACE_REALLOC_A: old block, size, block
+ * TRACE_FREE_A: block; also free_batch_a() and realloc_a() to 0 bytes
+ * TRACE_FREE_SIZED_A: block, size
+ */
+#define TRACE_MAGIC_A "ALLOCTR1"
+#define TRACE_MALLOC_A 1
+#define TRACE_CALLOC_A 2
+#define TRACE_ALIGNED_A 3
+#define TRACE_REALLOC_A 4
+#define TRACE_FREE_A 5
+#define TRACE_FREE_SIZED_A 6
+
+/*
+ * @brief Starts recording every call to the malloc_a() and free_a() families
+ * that succeeds. Each thread logs to a buffer of its own that is written to
+ * the file when full, at thread exit, on trace_stop_a() and at program exit.
+ * Replay the trace with the replay tool.
+ *
+ * @param fd File descriptor to write the trace to
+ *
+ * @return 0 on success, -1 if a trace is already being recorded or writing
+ * failed
+ */
+int trace_start_a(int fd);
+
+/*
+ * @brief Writes out the events recorded so far and stops recording. The file
+ * descriptor is left open.
+ *
+ * @return 0 on success, -1 if no trace was being recorded
+ */
+int trace_stop_a(void);
+
+/*
+ * @brief Adjusts an allocator tuning parameter
+ *
+ * @param param One of the M_*_A parameters
+ * @param value New value of the parameter
+ *
+ * @return 1 on success, 0 if the parameter is unknown
+ */
+int mallopt_a(int param, size_t value);
+
+/*
+ * @typedef arena_t
+ * @brief Region for building structures that are released all at once.
+ *
+ * Memory is handed out by bumping a pointer through chunks of the allocator,
+ * and is only given back by arena_reset_a() or arena_destroy_a(), never by
+ * free_a() or realloc_a(). An arena may be used by one thread at a time.
+ * Arenas still mapped at program termination are unmapped with the rest of
+ * the allocator.
+ */
+typedef struct arena arena_t;
+
+/*
+ * @brief Creates an empty arena
+ *
+ * @return Pointer to the arena on success, NULL on failure
+ */
+arena_t *arena_create_a(void);
+
+/*
+ * @brief Allocates memory from an arena
+ *
+ * @param arena Arena to allocate from
+ * @param size Number of bytes to allocate
+ *
+ * @return Pointer to memory aligned like malloc_a() on success, NULL on
+ * failure
+ */
+void *arena_alloc_a(arena_t *arena, size_t size);
+
+/*
+ * @brief Releases everything allocated from an arena at once. The arena keeps
+ * its chunks for the allocations that follow.
+ *
+ * @param arena Arena to reset
+ */
+void arena_reset_a(arena_t *arena);
+
+/*
+ * @brief Releases everything allocated from an arena and unmaps its chunks
+ *
+ * @param arena Arena to destroy
+ */
+void arena_destroy_a(arena_t *arena);
+
+/*
+ * @typedef pool_t
+ * @brief Pool of objects of a single size.
+ *
+ * Objects are carved back to back from chunks of the pool, and freed objects
+ * are kept on free lists threaded through their own memory, so an object has
+ * no header. Each thread keeps magazines of free objects, and allocating from
+ * a non-empty magazine pops a pointer. Objects must only be given back with
+ * pool_free_a() to the pool they came from. Pools live until
+ * pool_destroy_a() or program termination.
+ */
+typedef struct pool pool_t;
+
+/*
+ * @brief Creates a pool of objects
+ *
+ * @param obj_size Size of each object in bytes
+ * @param align Alignment of each object, a power of two up to the page size,
+ * or 0 for the alignment of malloc_a()
+ *
+ * @return Pointer to the pool on success, NULL on failure
+ */
+pool_t *pool_create_a(size_t obj_size, size_t align);
+
+/*
+ * @brief Allocates an object from a pool
+ *
+ * @param pool Pool to allocate from
+ *
+ * @return Pointer to the object on success, NULL on failure
+ */
+void *pool_alloc_a(pool_t *pool);
+
+/*
+ * @brief Returns an object to its pool
+ *
+ * @param pool Pool the object was allocated from
+ * @param obj Pointer to the object
+ */
+void pool_free_a(pool_t *pool, void *obj);
+
+/*
+ * @brief Unmaps a pool with all its objects, including those still held in
+ * the magazines of any thread. No thread may use the pool or its objects
+ * afterwards.
+ *
+ * @param pool Pool to destroy
+ */
+void pool_destroy_a(pool_t *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif // !ALLOCATOR_H
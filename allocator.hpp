@@ -0,0 +1,350 @@
+/*
+ * allocator.hpp : C++ interface to the allocator
+ *
+ * Allocators for standard containers and memory resources for pmr containers
+ * that route through the thread caches, pools, arenas and sized free of
+ * allocator.h. Defining ALLOCATOR_GLOBAL_NEW before including this header in
+ * exactly one translation unit also replaces the global operator new and
+ * delete, so every new expression of the program uses the allocator.
+ * Requires C++17.
+ */
+
+#ifndef ALLOCATOR_HPP
+#define ALLOCATOR_HPP
+
+#include "allocator.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <new>
+
+namespace allocator_a {
+
+/*
+ * @brief Allocates memory, throwing like operator new on failure
+ *
+ * @param size Number of bytes to allocate, 0 for a unique block
+ * @param alignment Alignment in bytes, a power of two up to 2 MiB
+ *
+ * @return Pointer to the allocated memory
+ */
+inline void *allocate_bytes(std::size_t size, std::size_t alignment) {
+  void *block = alignment <= alignof(std::max_align_t)
+                    ? malloc_a(size ? size : 1)
+                    : aligned_alloc_a(alignment, size ? size : 1);
+
+  if (!block)
+    throw std::bad_alloc();
+  return block;
+}
+
+/*
+ * @brief Frees memory from allocate_bytes(). Blocks aligned like malloc_a()
+ * go through free_sized_a(), which also takes the blocks allocated without a
+ * thread heap, such as from destructors running at thread or program exit.
+ */
+inline void deallocate_bytes(void *block, std::size_t size,
+                             std::size_t alignment) noexcept {
+  if (alignment <= alignof(std::max_align_t))
+    free_sized_a(block, size ? size : 1);
+  else
+    free_a(block);
+}
+
+/*
+ * @class stl_allocator
+ * @brief Allocator for standard containers. Objects come from the calling
+ * thread's heap and are given back with sized free. All instances are
+ * interchangeable.
+ */
+template <class T> class stl_allocator {
+public:
+  using value_type = T;
+
+  stl_allocator() noexcept = default;
+  template <class U> stl_allocator(const stl_allocator<U> &) noexcept {}
+
+  T *allocate(std::size_t n) {
+    if (n > SIZE_MAX / sizeof(T))
+      throw std::bad_array_new_length();
+    return static_cast<T *>(allocate_bytes(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T *block, std::size_t n) noexcept {
+    deallocate_bytes(block, n * sizeof(T), alignof(T));
+  }
+};
+
+template <class T, class U>
+bool operator==(const stl_allocator<T> &, const stl_allocator<U> &) noexcept {
+  return true;
+}
+
+template <class T, class U>
+bool operator!=(const stl_allocator<T> &, const stl_allocator<U> &) noexcept {
+  return false;
+}
+
+/*
+ * @class pool_allocator
+ * @brief Allocator for node-based containers such as std::list and std::map.
+ * Single objects come from a pool shared by all allocators of the type, and
+ * arrays from the heap like stl_allocator. All instances of a type are
+ * interchangeable.
+ */
+template <class T> class pool_allocator {
+public:
+  using value_type = T;
+
+  pool_allocator() noexcept = default;
+  template <class U> pool_allocator(const pool_allocator<U> &) noexcept {}
+
+  T *allocate(std::size_t n) {
+    if (n != 1)
+      return stl_allocator<T>().allocate(n);
+
+    void *obj = pool_alloc_a(pool());
+    if (!obj)
+      throw std::bad_alloc();
+    return static_cast<T *>(obj);
+  }
+
+  void deallocate(T *block, std::size_t n) noexcept {
+    if (n != 1)
+      stl_allocator<T>().deallocate(block, n);
+    else
+      pool_free_a(pool(), block);
+  }
+
+private:
+  /*
+   * @brief Returns the pool of the type, created on first use. A pool that
+   * cannot be created is fatal, as its objects could not be freed elsewhere.
+   */
+  static pool_t *pool() {
+    static pool_t *const pool = [] {
+      pool_t *created = pool_create_a(sizeof(T), alignof(T));
+
+      if (!created)
+        throw std::bad_alloc();
+      return created;
+    }();
+    return pool;
+  }
+};
+
+template <class T, class U>
+bool operator==(const pool_allocator<T> &, const pool_allocator<U> &) noexcept {
+  return true;
+}
+
+template <class T, class U>
+bool operator!=(const pool_allocator<T> &, const pool_allocator<U> &) noexcept {
+  return false;
+}
+
+/*
+ * @class heap_resource_t
+ * @brief Memory resource over the thread heaps, see heap_resource()
+ */
+class heap_resource_t : public std::pmr::memory_resource {
+private:
+  void *do_allocate(std::size_t size, std::size_t alignment) override {
+    return allocate_bytes(size, alignment);
+  }
+
+  void do_deallocate(void *block, std::size_t size,
+                     std::size_t alignment) override {
+    deallocate_bytes(block, size, alignment);
+  }
+
+  bool do_is_equal(const std::pmr::memory_resource &other)
+      const noexcept override {
+    return dynamic_cast<const heap_resource_t *>(&other) != nullptr;
+  }
+};
+
+/*
+ * @brief Returns the memory resource over the thread heaps, which can serve
+ * as the default resource or as the upstream of the standard pool resources
+ */
+inline std::pmr::memory_resource *heap_resource() noexcept {
+  static heap_resource_t resource;
+  return &resource;
+}
+
+/*
+ * @class arena_resource
+ * @brief Memory resource over an arena of its own. Deallocation does
+ * nothing, and the memory is released all at once by release() or the
+ * destructor. Like its arena, the resource may be used by one thread at a
+ * time.
+ */
+class arena_resource : public std::pmr::memory_resource {
+public:
+  arena_resource() : arena_(arena_create_a()) {
+    if (!arena_)
+      throw std::bad_alloc();
+  }
+
+  arena_resource(const arena_resource &) = delete;
+  arena_resource &operator=(const arena_resource &) = delete;
+
+  ~arena_resource() override { arena_destroy_a(arena_); }
+
+  /*
+   * @brief Releases everything allocated from the resource, keeping the
+   * arena's chunks for the allocations that follow
+   */
+  void release() noexcept { arena_reset_a(arena_); }
+
+private:
+  void *do_allocate(std::size_t size, std::size_t alignment) override {
+    std::size_t pad =
+        alignment > alignof(std::max_align_t) ? alignment - 1 : 0;
+
+    if (size > SIZE_MAX - pad)
+      throw std::bad_alloc();
+
+    void *block = arena_alloc_a(arena_, (size ? size : 1) + pad);
+    if (!block)
+      throw std::bad_alloc();
+
+    /* The arena aligns like malloc_a(), so larger alignments are padded */
+    std::uintptr_t address = reinterpret_cast<std::uintptr_t>(block);
+    address = (address + pad) & ~static_cast<std::uintptr_t>(pad);
+    return reinterpret_cast<void *>(address);
+  }
+
+  void do_deallocate(void *, std::size_t, std::size_t) override {}
+
+  bool do_is_equal(const std::pmr::memory_resource &other)
+      const noexcept override {
+    return this == &other;
+  }
+
+  arena_t *arena_;
+};
+
+} // namespace allocator_a
+
+#ifdef ALLOCATOR_GLOBAL_NEW
+
+/*
+ * Replacement of the global operator new and delete. Failures call the new
+ * handler and retry like the standard operators, sized delete frees with
+ * free_sized_a(), and over-aligned allocations use aligned_alloc_a().
+ */
+
+namespace allocator_a {
+
+inline void *new_bytes(std::size_t size, std::size_t alignment) {
+  for (;;) {
+    void *block = alignment <= alignof(std::max_align_t)
+                      ? malloc_a(size ? size : 1)
+                      : aligned_alloc_a(alignment, size ? size : 1);
+    if (block)
+      return block;
+
+    std::new_handler handler = std::get_new_handler();
+    if (!handler)
+      throw std::bad_alloc();
+    handler();
+  }
+}
+
+inline void *new_bytes_nothrow(std::size_t size,
+                               std::size_t alignment) noexcept {
+  try {
+    return new_bytes(size, alignment);
+  } catch (...) {
+    return nullptr;
+  }
+}
+
+} // namespace allocator_a
+
+void *operator new(std::size_t size) {
+  return allocator_a::new_bytes(size, alignof(std::max_align_t));
+}
+
+void *operator new[](std::size_t size) {
+  return allocator_a::new_bytes(size, alignof(std::max_align_t));
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept {
+  return allocator_a::new_bytes_nothrow(size, alignof(std::max_align_t));
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept {
+  return allocator_a::new_bytes_nothrow(size, alignof(std::max_align_t));
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  return allocator_a::new_bytes(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return allocator_a::new_bytes(size, static_cast<std::size_t>(alignment));
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment,
+                   const std::nothrow_t &) noexcept {
+  return allocator_a::new_bytes_nothrow(size,
+                                        static_cast<std::size_t>(alignment));
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment,
+                     const std::nothrow_t &) noexcept {
+  return allocator_a::new_bytes_nothrow(size,
+                                        static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *block) noexcept { free_a(block); }
+
+void operator delete[](void *block) noexcept { free_a(block); }
+
+void operator delete(void *block, const std::nothrow_t &) noexcept {
+  free_a(block);
+}
+
+void operator delete[](void *block, const std::nothrow_t &) noexcept {
+  free_a(block);
+}
+
+void operator delete(void *block, std::size_t size) noexcept {
+  free_sized_a(block, size ? size : 1);
+}
+
+void operator delete[](void *block, std::size_t size) noexcept {
+  free_sized_a(block, size ? size : 1);
+}
+
+void operator delete(void *block, std::align_val_t) noexcept { free_a(block); }
+
+void operator delete[](void *block, std::align_val_t) noexcept {
+  free_a(block);
+}
+
+void operator delete(void *block, std::align_val_t,
+                     const std::nothrow_t &) noexcept {
+  free_a(block);
+}
+
+void operator delete[](void *block, std::align_val_t,
+                       const std::nothrow_t &) noexcept {
+  free_a(block);
+}
+
+void operator delete(void *block, std::size_t, std::align_val_t) noexcept {
+  free_a(block);
+}
+
+void operator delete[](void *block, std::size_t, std::align_val_t) noexcept {
+  free_a(block);
+}
+
+#endif // ALLOCATOR_GLOBAL_NEW
+
+#endif // !ALLOCATOR_HPP
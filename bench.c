@@ -0,0 +1,602 @@
+/*
+ * bench.c : Benchmark harness for the allocator
+ *
+ * Runs standard allocation workloads at several thread counts and reports
+ * throughput, sampled per-operation latency and peak RSS. Every workload runs
+ * in a forked child so peak RSS is measured per run.
+ *
+ * Built against allocator.c by default. Building with -DBENCH_LIBC routes the
+ * workloads through the libc malloc family instead, which also allows
+ * comparing with jemalloc or mimalloc through LD_PRELOAD. Building with
+ * -DALLOCATOR_TIMING also prints the allocator's lock and call latency
+ * histograms after each run.
+ *
+ * Usage: bench [workload ...] [-t threads,threads,...]
+ */
+
+#include "allocator.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef BENCH_LIBC
+#define ALLOCATOR_NAME "libc"
+#define bench_malloc malloc
+#define bench_free free
+#define bench_realloc realloc
+#else
+#define ALLOCATOR_NAME "allocator"
+#define bench_malloc malloc_a
+#define bench_free free_a
+#define bench_realloc realloc_a
+#endif
+
+#define elapsed_ns(start, end)                                                 \
+  ((end.tv_sec - start.tv_sec) * 1000000000.0 + (end.tv_nsec - start.tv_nsec))
+
+/*
+ * One operation in LATENCY_SAMPLE_EVERY is timed individually, so the clock
+ * reads barely affect throughput
+ */
+#define LATENCY_SAMPLE_EVERY 16
+#define MAX_SAMPLES (1 << 16)
+#define MAX_THREADS 64
+
+/*
+ * Small linear congruential generator, so every run sees the same sequence of
+ * requests
+ */
+static unsigned next_random(unsigned *state) {
+  *state = *state * 1103515245u + 12345u;
+  return *state >> 8;
+}
+
+/*
+ * @struct worker_t
+ * @brief State of one benchmark thread
+ */
+typedef struct worker {
+  int id;
+  int nthreads;
+  unsigned seed;
+
+  /* Operations performed, one malloc, free or realloc each */
+  long ops;
+
+  /* When the thread started and finished its workload */
+  long start_ns, end_ns;
+
+  /* Sampled operation latencies in nanoseconds */
+  unsigned *samples;
+  int nsamples;
+} worker_t;
+
+static inline long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * Times one operation in LATENCY_SAMPLE_EVERY. The operation runs exactly
+ * once either way.
+ */
+#define TIMED(w, op)                                                           \
+  do {                                                                         \
+    if (((w)->ops++ % LATENCY_SAMPLE_EVERY) == 0 &&                            \
+        (w)->nsamples < MAX_SAMPLES) {                                         \
+      long t0_ = now_ns();                                                     \
+      op;                                                                      \
+      (w)->samples[(w)->nsamples++] = (unsigned)(now_ns() - t0_);              \
+    } else {                                                                   \
+      op;                                                                      \
+    }                                                                          \
+  } while (0)
+
+static void touch(void *p, size_t size) {
+  memset(p, 0xA5, size < 64 ? size : 64);
+}
+
+/*
+ * Uniform small sizes: allocate a batch of 16 to 256 byte objects and free it
+ * again, in LIFO order
+ */
+#define SMALL_BATCH 64
+#define SMALL_ROUNDS 20000
+
+static void workload_small(worker_t *w) {
+  void *objs[SMALL_BATCH];
+
+  for (int round = 0; round < SMALL_ROUNDS; round++) {
+    for (int i = 0; i < SMALL_BATCH; i++) {
+      size_t size = 16 + next_random(&w->seed) % 241;
+      TIMED(w, objs[i] = bench_malloc(size));
+      touch(objs[i], size);
+    }
+    for (int i = SMALL_BATCH - 1; i >= 0; i--)
+      TIMED(w, bench_free(objs[i]));
+  }
+}
+
+/*
+ * Producer/consumer: even threads allocate and hand each object to the next
+ * odd thread through a single-producer single-consumer ring, which frees it
+ */
+#define XTHREAD_OBJECTS 500000
+#define RING_SIZE 1024
+
+typedef struct ring {
+  void *slots[RING_SIZE];
+  unsigned long head;
+  char pad[64];
+  unsigned long tail;
+} ring_t;
+
+static ring_t rings[MAX_THREADS / 2];
+
+static void workload_xthread(worker_t *w) {
+  ring_t *ring = &rings[w->id / 2];
+
+  if (w->id % 2 == 0) {
+    for (long i = 0; i < XTHREAD_OBJECTS; i++) {
+      size_t size = 16 + next_random(&w->seed) % 497;
+      void *p;
+
+      TIMED(w, p = bench_malloc(size));
+      touch(p, size);
+      while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+                 __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+             RING_SIZE)
+        sched_yield();
+      ring->slots[ring->head % RING_SIZE] = p;
+      __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+  } else {
+    for (long i = 0; i < XTHREAD_OBJECTS; i++) {
+      void *p;
+
+      while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+             __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+        sched_yield();
+      p = ring->slots[ring->tail % RING_SIZE];
+      __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+      TIMED(w, bench_free(p));
+    }
+  }
+}
+
+/*
+ * Larson-style churn: each thread replaces random slots of its own array with
+ * new objects; after each round a fresh thread inherits the array, so blocks
+ * allocated by one thread are freed by another and threads come and go
+ */
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 10
+#define LARSON_OPS_PER_ROUND 100000
+
+typedef struct larson_arg {
+  worker_t *w;
+  void **slots;
+} larson_arg;
+
+static void *larson_round(void *arg) {
+  larson_arg *la = arg;
+  worker_t *w = la->w;
+
+  for (long i = 0; i < LARSON_OPS_PER_ROUND; i++) {
+    unsigned slot = next_random(&w->seed) % LARSON_SLOTS;
+    size_t size = 16 + next_random(&w->seed) % 1009;
+
+    if (la->slots[slot])
+      TIMED(w, bench_free(la->slots[slot]));
+    TIMED(w, la->slots[slot] = bench_malloc(size));
+    touch(la->slots[slot], size);
+  }
+
+  return NULL;
+}
+
+static void workload_larson(worker_t *w) {
+  void *slots[LARSON_SLOTS] = {0};
+  larson_arg la = {w, slots};
+
+  for (int round = 0; round < LARSON_ROUNDS; round++) {
+    pthread_t thread;
+
+    pthread_create(&thread, NULL, larson_round, &la);
+    pthread_join(thread, NULL);
+  }
+
+  for (int i = 0; i < LARSON_SLOTS; i++)
+    bench_free(slots[i]);
+}
+
+/*
+ * Realloc growth: grow a buffer by half its size at a time from 16 bytes up to
+ * 16 MiB, as an append-heavy vector would
+ */
+#define REALLOC_ROUNDS 1000
+#define REALLOC_MAX (16UL << 20)
+
+static void workload_realloc(worker_t *w) {
+  for (int round = 0; round < REALLOC_ROUNDS; round++) {
+    size_t size = 16;
+    char *buf;
+
+    TIMED(w, buf = bench_malloc(size));
+    while (size < REALLOC_MAX) {
+      size += size / 2;
+      TIMED(w, buf = bench_realloc(buf, size));
+      buf[size - 1] = 1;
+    }
+    TIMED(w, bench_free(buf));
+  }
+}
+
+/*
+ * Large objects: allocate and free 256 KiB to 8 MiB buffers, touching their
+ * first and last page
+ */
+#define LARGE_ROUNDS 20000
+
+static void workload_large(worker_t *w) {
+  for (int round = 0; round < LARGE_ROUNDS; round++) {
+    size_t size = (256UL << 10) + next_random(&w->seed) % (8UL << 20);
+    char *buf;
+
+    TIMED(w, buf = bench_malloc(size));
+    buf[0] = 1;
+    buf[size - 1] = 1;
+    TIMED(w, bench_free(buf));
+  }
+}
+
+typedef struct workload {
+  const char *name;
+  void (*run)(worker_t *w);
+} workload_t;
+
+static const workload_t workloads[] = {
+    {"small", workload_small},     {"xthread", workload_xthread},
+    {"larson", workload_larson},   {"realloc", workload_realloc},
+    {"large", workload_large},
+};
+
+#define NUM_WORKLOADS (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+static const workload_t *current;
+static pthread_barrier_t start_barrier;
+
+static void *worker_main(void *arg) {
+  worker_t *w = arg;
+
+  pthread_barrier_wait(&start_barrier);
+  w->start_ns = now_ns();
+  current->run(w);
+  w->end_ns = now_ns();
+  return NULL;
+}
+
+static int compare_unsigned(const void *a, const void *b) {
+  unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * @brief Runs a workload with the given number of threads and prints one
+ * result line. Meant to run in a child process of its own.
+ */
+static void run_workload(const workload_t *workload, int nthreads) {
+  static worker_t workers[MAX_THREADS];
+  pthread_t threads[MAX_THREADS];
+  struct rusage usage;
+  unsigned *samples;
+  long ops = 0, start = 0, end = 0;
+  int nsamples = 0;
+
+  current = workload;
+  pthread_barrier_init(&start_barrier, NULL, (unsigned)nthreads + 1);
+
+  for (int i = 0; i < nthreads; i++) {
+    workers[i].id = i;
+    workers[i].nthreads = nthreads;
+    workers[i].seed = 1234u + (unsigned)i * 7919u;
+    workers[i].ops = 0;
+    workers[i].nsamples = 0;
+    workers[i].samples = malloc(MAX_SAMPLES * sizeof(unsigned));
+    pthread_create(&threads[i], NULL, worker_main, &workers[i]);
+  }
+
+  pthread_barrier_wait(&start_barrier);
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+
+  /* Throughput is measured from the first thread starting to the last one
+   * finishing */
+  for (int i = 0; i < nthreads; i++) {
+    if (!start || workers[i].start_ns < start)
+      start = workers[i].start_ns;
+    if (workers[i].end_ns > end)
+      end = workers[i].end_ns;
+    ops += workers[i].ops;
+    nsamples += workers[i].nsamples;
+  }
+
+  samples = malloc((size_t)nsamples * sizeof(unsigned) + 1);
+  nsamples = 0;
+  for (int i = 0; i < nthreads; i++) {
+    memcpy(samples + nsamples, workers[i].samples,
+           (size_t)workers[i].nsamples * sizeof(unsigned));
+    nsamples += workers[i].nsamples;
+  }
+  qsort(samples, (size_t)nsamples, sizeof(unsigned), compare_unsigned);
+
+  getrusage(RUSAGE_SELF, &usage);
+
+  printf("%-10s %-8s %3d %14.0f %9u %9u %12.1f\n", ALLOCATOR_NAME,
+         workload->name, nthreads, ops * 1e9 / (double)(end - start),
+         nsamples ? samples[nsamples / 2] : 0,
+         nsamples ? samples[(long)nsamples * 99 / 100] : 0,
+         usage.ru_maxrss / 1024.0);
+}
+
+#ifndef BENCH_LIBC
+
+static const char *policy_names[] = {"first-fit", "best-fit", "good-fit"};
+
+#define FREE_TEST_THREADS 8
+#define ALLOCS_PER_THREAD 50
+#define FREE_TEST_ROUNDS 2000
+
+typedef struct free_pattern_arg {
+  size_t scale;
+  size_t peak_live;
+} free_pattern_arg;
+
+/*
+ * The pattern of test_multithreaded_free in test.c, repeated: allocate blocks
+ * of growing size, then free the even ones and then the odd ones.
+ */
+static void *free_pattern_thread(void *arg) {
+  free_pattern_arg *fa = arg;
+  void *allocations[ALLOCS_PER_THREAD];
+
+  for (int round = 0; round < FREE_TEST_ROUNDS; round++) {
+    size_t live = 0;
+
+    for (int i = 0; i < ALLOCS_PER_THREAD; i++) {
+      size_t size = (i + 1) * 16 * fa->scale;
+      allocations[i] = malloc_a(size);
+      if (!allocations[i]) {
+        printf("allocation failed\n");
+        return NULL;
+      }
+      touch(allocations[i], size);
+      live += size;
+    }
+    if (live > fa->peak_live)
+      fa->peak_live = live;
+
+    for (int i = 0; i < ALLOCS_PER_THREAD; i += 2)
+      free_a(allocations[i]);
+    for (int i = 1; i < ALLOCS_PER_THREAD; i += 2)
+      free_a(allocations[i]);
+  }
+
+  return NULL;
+}
+
+static void bench_free_pattern(size_t scale) {
+  pthread_t threads[FREE_TEST_THREADS];
+  free_pattern_arg args[FREE_TEST_THREADS];
+  struct timespec start, end;
+  alloc_stats_t stats;
+  size_t peak_live = 0;
+  double ops;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int i = 0; i < FREE_TEST_THREADS; ++i) {
+    args[i].scale = scale;
+    args[i].peak_live = 0;
+    pthread_create(&threads[i], NULL, free_pattern_thread, &args[i]);
+  }
+  for (int i = 0; i < FREE_TEST_THREADS; ++i) {
+    pthread_join(threads[i], NULL);
+    peak_live += args[i].peak_live;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  stats_a(&stats);
+  ops = 2.0 * FREE_TEST_THREADS * FREE_TEST_ROUNDS * ALLOCS_PER_THREAD;
+  printf("  free pattern x%-3zu %8.1f ns/op  mapped %7.2f MiB  peak live "
+         "%7.2f MiB  free lists %7.2f MiB\n",
+         scale, elapsed_ns(start, end) / ops,
+         stats.bytes_mapped / 1048576.0, peak_live / 1048576.0,
+         stats.bytes_free / 1048576.0);
+}
+
+#define CHURN_SLOTS 8192
+#define CHURN_STEPS 2000000
+
+/*
+ * @brief Draws a request size from a mix of mostly small objects, some
+ * medium buffers and a few large ones
+ */
+static size_t churn_size(unsigned *state) {
+  unsigned kind = next_random(state) % 100;
+
+  if (kind < 70)
+    return 16 + next_random(state) % 496;
+  if (kind < 95)
+    return 512 + next_random(state) % (16 * 1024);
+  return 16 * 1024 + next_random(state) % (240 * 1024);
+}
+
+/*
+ * A long-running churn trace: a working set of slots where each step replaces
+ * a random slot with a new allocation of a random size.
+ */
+static void bench_churn(void) {
+  static void *slots[CHURN_SLOTS];
+  static size_t sizes[CHURN_SLOTS];
+  struct timespec start, end;
+  alloc_stats_t stats;
+  size_t live = 0, peak_live = 0, peak_mapped = 0;
+  unsigned state = 42;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long step = 0; step < CHURN_STEPS; step++) {
+    unsigned i = next_random(&state) % CHURN_SLOTS;
+
+    if (slots[i]) {
+      free_a(slots[i]);
+      live -= sizes[i];
+    }
+
+    sizes[i] = churn_size(&state);
+    slots[i] = malloc_a(sizes[i]);
+    if (!slots[i]) {
+      printf("allocation failed\n");
+      return;
+    }
+    touch(slots[i], sizes[i]);
+    live += sizes[i];
+
+    if (live > peak_live)
+      peak_live = live;
+    if (step % 10000 == 0) {
+      stats_a(&stats);
+      if (stats.bytes_mapped > peak_mapped)
+        peak_mapped = stats.bytes_mapped;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  stats_a(&stats);
+  printf("  churn           %8.1f ns/op  peak mapped %7.2f MiB  peak live "
+         "%7.2f MiB  mapped/live %.2f  free lists %7.2f MiB\n",
+         elapsed_ns(start, end) / (2.0 * CHURN_STEPS),
+         peak_mapped / 1048576.0, peak_live / 1048576.0,
+         (double)stats.bytes_mapped / (double)live,
+         stats.bytes_free / 1048576.0);
+
+  for (int i = 0; i < CHURN_SLOTS; i++)
+    free_a(slots[i]);
+}
+
+/*
+ * @brief Compares fragmentation and latency of the placement policies
+ */
+static void bench_placement(void) {
+  for (int policy = PLACEMENT_FIRST_FIT_A; policy <= PLACEMENT_GOOD_FIT_A;
+       policy++) {
+    pid_t pid = fork();
+
+    if (pid < 0) {
+      printf("fork failed\n");
+      return;
+    }
+
+    if (pid == 0) {
+      mallopt_a(M_PLACEMENT_A, (size_t)policy);
+      printf("%s\n", policy_names[policy]);
+      bench_free_pattern(1);
+      bench_free_pattern(32);
+      bench_churn();
+      fflush(stdout);
+      _exit(0);
+    }
+
+    waitpid(pid, NULL, 0);
+  }
+}
+
+#endif
+
+/*
+ * @brief Runs a workload in a child process of its own, so each run starts
+ * from an empty heap and reports its own peak RSS
+ */
+static void run_forked(const workload_t *workload, int nthreads) {
+  pid_t pid;
+
+  fflush(stdout);
+  pid = fork();
+
+  if (pid < 0) {
+    printf("fork failed\n");
+    return;
+  }
+
+  if (pid == 0) {
+    run_workload(workload, nthreads);
+    fflush(stdout);
+#if defined(ALLOCATOR_TIMING) && !defined(BENCH_LIBC)
+    malloc_stats_a();
+#endif
+    _exit(0);
+  }
+
+  waitpid(pid, NULL, 0);
+}
+
+int main(int argc, char **argv) {
+  int thread_counts[MAX_THREADS] = {1, 2, 4, 8};
+  int nthread_counts = 4;
+  int selected[NUM_WORKLOADS] = {0};
+  int any_selected = 0;
+
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+      char *list = argv[++i];
+      nthread_counts = 0;
+      for (char *tok = strtok(list, ","); tok && nthread_counts < MAX_THREADS;
+           tok = strtok(NULL, ",")) {
+        int n = atoi(tok);
+        if (n > 0 && n <= MAX_THREADS)
+          thread_counts[nthread_counts++] = n;
+      }
+      continue;
+    }
+
+#ifndef BENCH_LIBC
+    if (!strcmp(argv[i], "placement")) {
+      bench_placement();
+      any_selected = -1;
+      continue;
+    }
+#endif
+
+    for (int j = 0; j < NUM_WORKLOADS; j++) {
+      if (!strcmp(argv[i], workloads[j].name)) {
+        selected[j] = 1;
+        any_selected = 1;
+      }
+    }
+  }
+
+  if (any_selected < 0)
+    return 0;
+
+  printf("%-10s %-8s %3s %14s %9s %9s %12s\n", "allocator", "workload",
+         "thr", "ops/sec", "p50 ns", "p99 ns", "peak RSS MiB");
+
+  for (int j = 0; j < NUM_WORKLOADS; j++) {
+    if (any_selected && !selected[j])
+      continue;
+    for (int t = 0; t < nthread_counts; t++) {
+      /* The producer/consumer workload needs its threads in pairs */
+      if (workloads[j].run == workload_xthread && thread_counts[t] % 2)
+        continue;
+      run_forked(&workloads[j], thread_counts[t]);
+    }
+  }
+
+  return 0;
+}
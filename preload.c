@@ -0,0 +1,130 @@
+/*
+ * preload.c : Replacement of the libc malloc family by the allocator
+ *
+ * Built as a shared library and loaded with LD_PRELOAD, see README, so
+ * programs run on the allocator without code changes. Each function forwards
+ * to its _a counterpart with the semantics libc callers rely on: a request of
+ * 0 bytes returns a unique pointer, and failures set errno. Setting
+ * ALLOCATOR_TRACE=<path> records an allocation trace of the program to
+ * <path>.<pid>, see trace_start_a().
+ */
+
+#include "allocator.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * @brief Starts the trace asked for by ALLOCATOR_TRACE
+ */
+__attribute__((constructor)) static void preload_init(void) {
+  const char *trace = getenv("ALLOCATOR_TRACE");
+  char path[4096];
+  int fd;
+
+  /* The pid keeps the programs a traced program runs from sharing its file */
+  if (trace && snprintf(path, sizeof(path), "%s.%d", trace, (int)getpid()) <
+                   (int)sizeof(path)) {
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0 && trace_start_a(fd))
+      close(fd);
+  }
+}
+
+/*
+ * @brief Allocates a block aligned to a power of two
+ *
+ * @return Pointer to the block, or NULL with errno set to ENOMEM
+ */
+static void *preload_aligned(size_t alignment, size_t size) {
+  void *block = aligned_alloc_a(alignment, size ? size : 1);
+
+  if (!block)
+    errno = ENOMEM;
+  return block;
+}
+
+void *malloc(size_t size) {
+  void *block = malloc_a(size ? size : 1);
+
+  if (!block)
+    errno = ENOMEM;
+  return block;
+}
+
+void free(void *block) { free_a(block); }
+
+void *calloc(size_t num, size_t nsize) {
+  void *block;
+
+  if (nsize && num > SIZE_MAX / nsize) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  block = num && nsize ? calloc_a(num, nsize) : calloc_a(1, 1);
+  if (!block)
+    errno = ENOMEM;
+  return block;
+}
+
+void *realloc(void *block, size_t size) {
+  void *ret;
+
+  if (!block)
+    return malloc(size);
+
+  ret = realloc_a(block, size);
+  if (!ret && size)
+    errno = ENOMEM;
+  return ret;
+}
+
+void *reallocarray(void *block, size_t num, size_t nsize) {
+  if (nsize && num > SIZE_MAX / nsize) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return realloc(block, num * nsize);
+}
+
+void *memalign(size_t alignment, size_t size) {
+  size_t align = sizeof(void *);
+
+  /* Like glibc, an alignment that is not a power of two is rounded up */
+  while (align < alignment && align <= SIZE_MAX / 2)
+    align <<= 1;
+  return preload_aligned(align, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  if (!alignment || (alignment & (alignment - 1))) {
+    errno = EINVAL;
+    return NULL;
+  }
+  return preload_aligned(alignment, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  return posix_memalign_a(memptr, alignment, size ? size : 1);
+}
+
+void *valloc(size_t size) {
+  return preload_aligned((size_t)sysconf(_SC_PAGESIZE), size);
+}
+
+void *pvalloc(size_t size) {
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+  if (size > SIZE_MAX - page) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return preload_aligned(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void *block) { return malloc_usable_size_a(block); }
@@ -0,0 +1,489 @@
+/*
+ * replay.c : Replays an allocation trace recorded with trace_start_a()
+ *
+ * Decodes the trace, orders its events by sequence number and re-executes
+ * them with one thread per traced thread. A thread only waits for the events
+ * that allocated the blocks it frees or resizes, so the threads run about as
+ * concurrently as in the traced program. Frees of blocks allocated before
+ * recording started are skipped. Reports throughput, the peak of the bytes
+ * live and the peak RSS of the replay, whose ratio approximates
+ * fragmentation. The replay's own bookkeeping is mapped directly, so the
+ * allocator only serves the traced calls.
+ *
+ * Built against allocator.c by default. Building with -DREPLAY_LIBC replays
+ * through the libc malloc family instead, which also allows comparing with
+ * jemalloc or mimalloc through LD_PRELOAD.
+ *
+ * Usage: replay trace-file
+ */
+
+#define _GNU_SOURCE
+
+#include "allocator.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef REPLAY_LIBC
+#define ALLOCATOR_NAME "libc"
+#define replay_malloc malloc
+#define replay_calloc calloc
+#define replay_aligned aligned_alloc
+#define replay_realloc realloc
+#define replay_free free
+#define replay_free_sized(block, size) free(block)
+#else
+#define ALLOCATOR_NAME "allocator"
+#define replay_malloc malloc_a
+#define replay_calloc calloc_a
+#define replay_aligned aligned_alloc_a
+#define replay_realloc realloc_a
+#define replay_free free_a
+#define replay_free_sized free_sized_a
+#endif
+
+/* Allocations are touched once per page, like a program using them would */
+#define TOUCH_STRIDE 4096
+
+/*
+ * @struct event_t
+ * @brief One traced call, and its outcome during the replay
+ */
+typedef struct event {
+  uint64_t seq;
+  uint64_t size;
+
+  /* Traced block, and the old block or alignment, see TRACE_MAGIC_A */
+  uint64_t block;
+  uint64_t old;
+
+  /* Event that allocated the block freed or resized, -1 for none */
+  long dep;
+
+  uint32_t thread;
+  int op;
+
+  /* Block of the replay, and whether the event was replayed */
+  void *result;
+  int done;
+} event_t;
+
+/*
+ * @struct player_t
+ * @brief Replay thread, executing the events of one traced thread
+ */
+typedef struct player {
+  event_t *events;
+  long *order;
+  long count;
+} player_t;
+
+static pthread_barrier_t start_barrier;
+
+static inline long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/*
+ * @brief Maps zeroed memory for the replay's bookkeeping, exiting on failure
+ */
+static void *map_array(size_t count, size_t size) {
+  void *array;
+
+  if (count && size > SIZE_MAX / count) {
+    fprintf(stderr, "trace too large\n");
+    exit(1);
+  }
+  array = mmap(NULL, count ? count * size : 1, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (array == MAP_FAILED) {
+    perror("mmap");
+    exit(1);
+  }
+  return array;
+}
+
+/*
+ * @brief Reads a LEB128 varint, exiting on a truncated trace
+ */
+static uint64_t read_varint(const unsigned char **p, const unsigned char *end) {
+  uint64_t value = 0;
+  int shift = 0;
+
+  while (*p < end && shift < 64) {
+    unsigned char byte = *(*p)++;
+
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      return value;
+    shift += 7;
+  }
+  fprintf(stderr, "corrupt trace\n");
+  exit(1);
+}
+
+static uint64_t read_block(const unsigned char **p, const unsigned char *end,
+                           uint64_t *last) {
+  uint64_t zigzag = read_varint(p, end);
+
+  *last += (zigzag >> 1) ^ (0 - (zigzag & 1));
+  return *last;
+}
+
+/*
+ * @brief Decodes the events of a trace file
+ *
+ * @return The events, in file order, with their count in count
+ */
+static event_t *decode(const unsigned char *data, size_t size, long *count) {
+  const unsigned char *p = data + 8, *end = data + size;
+  event_t *events;
+  long n = 0;
+
+  if (size < 8 || memcmp(data, TRACE_MAGIC_A, 8)) {
+    fprintf(stderr, "not an allocation trace\n");
+    exit(1);
+  }
+
+  /* Every event takes at least three bytes */
+  events = map_array(size / 3 + 1, sizeof(event_t));
+
+  while (p < end) {
+    uint32_t thread, length;
+    const unsigned char *block_end;
+    uint64_t seq = 0, last = 0;
+
+    if ((size_t)(end - p) < 2 * sizeof(uint32_t)) {
+      fprintf(stderr, "corrupt trace\n");
+      exit(1);
+    }
+    memcpy(&thread, p, sizeof(thread));
+    memcpy(&length, p + sizeof(thread), sizeof(length));
+    p += 2 * sizeof(uint32_t);
+    if (length > (size_t)(end - p)) {
+      fprintf(stderr, "corrupt trace\n");
+      exit(1);
+    }
+
+    for (block_end = p + length; p < block_end; n++) {
+      event_t *e = &events[n];
+
+      e->op = *p++;
+      e->thread = thread;
+      e->seq = seq += read_varint(&p, block_end);
+      e->dep = -1;
+
+      switch (e->op) {
+      case TRACE_MALLOC_A:
+      case TRACE_CALLOC_A:
+        e->size = read_varint(&p, block_end);
+        e->block = read_block(&p, block_end, &last);
+        break;
+      case TRACE_ALIGNED_A:
+        e->old = read_varint(&p, block_end);
+        e->size = read_varint(&p, block_end);
+        e->block = read_block(&p, block_end, &last);
+        break;
+      case TRACE_REALLOC_A:
+        e->old = read_block(&p, block_end, &last);
+        e->size = read_varint(&p, block_end);
+        e->block = read_block(&p, block_end, &last);
+        break;
+      case TRACE_FREE_A:
+        e->block = read_block(&p, block_end, &last);
+        break;
+      case TRACE_FREE_SIZED_A:
+        e->block = read_block(&p, block_end, &last);
+        e->size = read_varint(&p, block_end);
+        break;
+      default:
+        fprintf(stderr, "corrupt trace\n");
+        exit(1);
+      }
+    }
+  }
+
+  *count = n;
+  return events;
+}
+
+static int compare_seq(const void *a, const void *b) {
+  uint64_t x = ((const event_t *)a)->seq, y = ((const event_t *)b)->seq;
+  return x < y ? -1 : x > y;
+}
+
+/*
+ * @struct live_map_t
+ * @brief Open addressing table from traced blocks to the events that
+ * allocated them, with linear probing and backward shift deletion
+ */
+typedef struct live_map {
+  uint64_t *keys;
+  long *values;
+  size_t mask;
+} live_map_t;
+
+static inline size_t live_slot(const live_map_t *map, uint64_t key) {
+  return (size_t)((key >> 4) * 0x9e3779b97f4a7c15ULL) & map->mask;
+}
+
+static void live_put(live_map_t *map, uint64_t key, long value) {
+  size_t i = live_slot(map, key);
+
+  while (map->keys[i] && map->keys[i] != key)
+    i = (i + 1) & map->mask;
+  map->keys[i] = key;
+  map->values[i] = value;
+}
+
+/*
+ * @brief Removes a block from the table
+ *
+ * @return Event that allocated it, or -1 if it is not live
+ */
+static long live_take(live_map_t *map, uint64_t key) {
+  size_t i = live_slot(map, key), j;
+  long value;
+
+  while (map->keys[i] != key) {
+    if (!map->keys[i])
+      return -1;
+    i = (i + 1) & map->mask;
+  }
+  value = map->values[i];
+
+  /* Entries after the hole that probed past it move back into it */
+  for (j = (i + 1) & map->mask; map->keys[j]; j = (j + 1) & map->mask) {
+    size_t home = live_slot(map, map->keys[j]);
+
+    if (((j - home) & map->mask) >= ((j - i) & map->mask)) {
+      map->keys[i] = map->keys[j];
+      map->values[i] = map->values[j];
+      i = j;
+    }
+  }
+  map->keys[i] = 0;
+  return value;
+}
+
+/*
+ * @brief Links every free and resize to the event that allocated its block,
+ * and sums up the bytes live
+ *
+ * @return Peak of the bytes requested and not freed yet
+ */
+static uint64_t resolve(event_t *events, long count) {
+  live_map_t map;
+  uint64_t live = 0, peak = 0;
+  size_t slots = 16;
+
+  while (slots < (size_t)count * 2)
+    slots <<= 1;
+  map.keys = map_array(slots, sizeof(uint64_t));
+  map.values = map_array(slots, sizeof(long));
+  map.mask = slots - 1;
+
+  for (long i = 0; i < count; i++) {
+    event_t *e = &events[i];
+    long stale;
+
+    switch (e->op) {
+    case TRACE_FREE_A:
+    case TRACE_FREE_SIZED_A:
+      e->dep = live_take(&map, e->block);
+      if (e->dep >= 0)
+        live -= events[e->dep].size;
+      break;
+    case TRACE_REALLOC_A:
+      e->dep = live_take(&map, e->old);
+      if (e->dep >= 0)
+        live -= events[e->dep].size;
+      else
+        e->op = TRACE_MALLOC_A;
+      /* fall through */
+    default:
+      /* The block is still live when its free raced with this allocation in
+       * another thread and got the later sequence number */
+      stale = live_take(&map, e->block);
+      if (stale >= 0)
+        live -= events[stale].size;
+      live_put(&map, e->block, i);
+      live += e->size;
+      break;
+    }
+    if (live > peak)
+      peak = live;
+  }
+
+  munmap(map.keys, slots * sizeof(uint64_t));
+  munmap(map.values, slots * sizeof(long));
+  return peak;
+}
+
+static inline void touch(void *block, uint64_t size) {
+  for (uint64_t offset = 0; block && offset < size; offset += TOUCH_STRIDE)
+    ((volatile char *)block)[offset] = 1;
+}
+
+static void *player_main(void *arg) {
+  player_t *player = arg;
+  event_t *events = player->events;
+
+  pthread_barrier_wait(&start_barrier);
+
+  for (long k = 0; k < player->count; k++) {
+    event_t *e = &events[player->order[k]];
+    void *block = NULL;
+
+    if (e->dep >= 0) {
+      for (int spins = 0;
+           !__atomic_load_n(&events[e->dep].done, __ATOMIC_ACQUIRE); spins++)
+        if (spins > 64)
+          sched_yield();
+      block = events[e->dep].result;
+    } else if (e->op == TRACE_FREE_A || e->op == TRACE_FREE_SIZED_A) {
+      continue;
+    }
+
+    switch (e->op) {
+    case TRACE_MALLOC_A:
+      e->result = replay_malloc(e->size);
+      touch(e->result, e->size);
+      break;
+    case TRACE_CALLOC_A:
+      e->result = replay_calloc(1, e->size);
+      break;
+    case TRACE_ALIGNED_A:
+      e->result = replay_aligned(e->old, e->size);
+      touch(e->result, e->size);
+      break;
+    case TRACE_REALLOC_A:
+      e->result = replay_realloc(block, e->size);
+      touch(e->result, e->size);
+      break;
+    case TRACE_FREE_A:
+      replay_free(block);
+      break;
+    case TRACE_FREE_SIZED_A:
+      replay_free_sized(block, e->size);
+      break;
+    }
+    __atomic_store_n(&e->done, 1, __ATOMIC_RELEASE);
+  }
+  return NULL;
+}
+
+/*
+ * @brief Reads a field of /proc/self/status, in KiB
+ */
+static long status_kib(const char *field) {
+  char buf[4096], *line;
+  int fd = open("/proc/self/status", O_RDONLY | O_CLOEXEC);
+  ssize_t len;
+
+  if (fd < 0)
+    return 0;
+  len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return 0;
+  buf[len] = '\0';
+
+  line = strstr(buf, field);
+  return line ? atol(line + strlen(field) + 1) : 0;
+}
+
+int main(int argc, char **argv) {
+  player_t *players;
+  event_t *events;
+  pthread_t *threads;
+  struct stat st;
+  uint64_t peak_live;
+  uint32_t nthreads = 0;
+  long count, ops = 0, start, end, rss_before;
+  void *data;
+  int fd;
+
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s trace-file\n", argv[0]);
+    return 2;
+  }
+
+  fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st)) {
+    perror(argv[1]);
+    return 1;
+  }
+  data = mmap(NULL, (size_t)st.st_size ? (size_t)st.st_size : 1, PROT_READ,
+              MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+
+  events = decode(data, (size_t)st.st_size, &count);
+  munmap(data, (size_t)st.st_size ? (size_t)st.st_size : 1);
+  close(fd);
+
+  qsort(events, (size_t)count, sizeof(event_t), compare_seq);
+  peak_live = resolve(events, count);
+
+  for (long i = 0; i < count; i++)
+    if (events[i].thread >= nthreads)
+      nthreads = events[i].thread + 1;
+
+  players = map_array(nthreads, sizeof(player_t));
+  threads = map_array(nthreads, sizeof(pthread_t));
+  for (long i = 0; i < count; i++)
+    players[events[i].thread].count++;
+  for (uint32_t t = 0; t < nthreads; t++) {
+    players[t].events = events;
+    players[t].order = map_array((size_t)players[t].count, sizeof(long));
+    players[t].count = 0;
+  }
+  for (long i = 0; i < count; i++) {
+    player_t *player = &players[events[i].thread];
+
+    player->order[player->count++] = i;
+    if (events[i].dep >= 0 || (events[i].op != TRACE_FREE_A &&
+                               events[i].op != TRACE_FREE_SIZED_A))
+      ops++;
+  }
+
+  /* Peak RSS is measured from here, by resetting the high water mark */
+  fd = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    if (write(fd, "5", 1) < 0)
+      perror("clear_refs");
+    close(fd);
+  }
+  rss_before = status_kib("VmRSS");
+
+  pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+  for (uint32_t t = 0; t < nthreads; t++)
+    pthread_create(&threads[t], NULL, player_main, &players[t]);
+
+  start = now_ns();
+  pthread_barrier_wait(&start_barrier);
+  for (uint32_t t = 0; t < nthreads; t++)
+    pthread_join(threads[t], NULL);
+  end = now_ns();
+
+  printf("%-10s %7s %12s %14s %14s %14s\n", "allocator", "threads", "events",
+         "ops/sec", "peak live MiB", "peak RSS MiB");
+  printf("%-10s %7u %12ld %14.0f %14.1f %14.1f\n", ALLOCATOR_NAME, nthreads,
+         ops, ops * 1e9 / (double)(end - start), peak_live / 1048576.0,
+         (status_kib("VmHWM") - rss_before) / 1024.0);
+  return 0;
+}
@@ -1,9 +1,14 @@
 #include "allocator.h"
 
+#include <errno.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <time.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 typedef struct Node {
   int value;
@@ -104,6 +109,772 @@ void test_realloc_a() {
   printf("realloc_a test complete\n");
 }
 
+void test_realloc_a_large(void) {
+  printf("Test: growing and shrinking a large block with realloc_a\n");
+
+  size_t size = 2 * 1024 * 1024;
+  unsigned char *buf = malloc_a(size);
+  if (!buf) {
+    printf("malloc_a failed\n");
+    return;
+  }
+  memset(buf, 0x5A, size);
+
+  for (int i = 0; i < 5; ++i) {
+    unsigned char *grown = realloc_a(buf, size * 2);
+    if (!grown) {
+      printf("realloc_a to %zu bytes failed\n", size * 2);
+      free_a(buf);
+      return;
+    }
+    buf = grown;
+    if (buf[0] != 0x5A || buf[size - 1] != 0x5A) {
+      printf("contents lost growing to %zu bytes\n", size * 2);
+      free_a(buf);
+      return;
+    }
+    memset(buf + size, 0x5A, size);
+    size *= 2;
+  }
+
+  buf = realloc_a(buf, 4 * 1024 * 1024);
+  if (!buf) {
+    printf("realloc_a shrink failed\n");
+    return;
+  }
+  printf("Grew to %zu bytes, shrunk back, byte 0: %#x\n", size, buf[0]);
+  free_a(buf);
+
+  printf("large realloc_a test complete\n");
+}
+
+void test_realloc_a_in_place(void) {
+  printf("Test: resizing a block in place with realloc_a\n");
+
+  unsigned char *buf = malloc_a(4000), *next = malloc_a(4000);
+  void *guard = malloc_a(4000);
+  if (!buf || !next || !guard) {
+    printf("malloc_a failed\n");
+    return;
+  }
+  memset(buf, 0x3C, 4000);
+
+  /* Growing absorbs the free neighbour instead of copying */
+  free_a(next);
+  unsigned char *grown = realloc_a(buf, 8000);
+  if (!grown) {
+    printf("realloc_a to 8000 bytes failed\n");
+    return;
+  }
+  printf("grew in place: %s, contents kept: %s\n",
+         grown == buf ? "yes" : "no",
+         grown[0] == 0x3C && grown[3999] == 0x3C ? "yes" : "no");
+
+  /* Shrinking splits the tail off as a free block */
+  alloc_stats_t before, after;
+  stats_a(&before);
+  unsigned char *shrunk = realloc_a(grown, 2000);
+  stats_a(&after);
+  printf("shrunk in place: %s, tail freed: %s\n",
+         shrunk == grown ? "yes" : "no",
+         after.free_blocks_large > before.free_blocks_large ? "yes" : "no");
+
+  free_a(shrunk);
+  free_a(guard);
+  printf("in-place realloc_a test complete\n");
+}
+
+void test_large_cache(void) {
+  alloc_stats_t before, after;
+
+  printf("Test: reuse of freed large mappings\n");
+
+  /* A freed mapping serves the next large request, smaller ones included,
+   * and grows in place up to its size */
+  free_a(malloc_a(8 << 20));
+  stats_a(&before);
+  char *block = malloc_a(3 << 20);
+  char *grown = block ? realloc_a(block, 6 << 20) : NULL;
+  stats_a(&after);
+  printf("mapping %s, growth %s\n",
+         after.mmap_count == before.mmap_count ? "reused" : "mapped anew",
+         grown == block && after.mremap_count == before.mremap_count
+             ? "in place"
+             : "moved");
+  free_a(grown ? grown : block);
+
+  /* Trimming unmaps the cached mappings */
+  stats_a(&before);
+  trim_a();
+  stats_a(&after);
+  printf("trim_a %s the cached mapping\n",
+         after.bytes_mapped < before.bytes_mapped ? "unmapped" : "kept");
+  printf("large mapping cache test complete\n");
+}
+
+void test_trim_a(void) {
+  printf("Test: trim_a after freeing large blocks\n");
+
+  void *blocks[8];
+  for (int i = 0; i < 8; ++i) {
+    blocks[i] = malloc_a(256 * 1024);
+    if (!blocks[i]) {
+      printf("malloc_a failed\n");
+      return;
+    }
+    memset(blocks[i], i, 256 * 1024);
+  }
+
+  for (int i = 0; i < 8; ++i)
+    free_a(blocks[i]);
+
+  printf("trim_a released memory: %s\n", trim_a() ? "yes" : "no");
+
+  void *again = malloc_a(256 * 1024);
+  if (!again) {
+    printf("malloc_a after trim_a failed\n");
+    return;
+  }
+  memset(again, 0xCD, 256 * 1024);
+  free_a(again);
+
+  printf("trim_a test complete\n");
+}
+
+void test_stats_a(void) {
+  printf("Test: stats_a internal fragmentation\n");
+
+  void *big = malloc_a(64 * 1024);
+  if (!big) {
+    printf("malloc_a failed\n");
+    return;
+  }
+  free_a(big);
+
+  /* Reuses the freed block, splitting off the unused remainder */
+  void *medium = malloc_a(2000);
+  if (!medium) {
+    printf("malloc_a failed\n");
+    return;
+  }
+
+  alloc_stats_t stats;
+  stats_a(&stats);
+  printf("requested %zu bytes, handed out %zu bytes, fragmentation %.2f%%\n",
+         stats.bytes_requested, stats.bytes_handed_out,
+         stats.internal_fragmentation * 100.0);
+  printf("in use %zu bytes over %zu malloc_a and %zu free_a calls\n",
+         stats.bytes_in_use, stats.malloc_count, stats.free_count);
+  free_a(medium);
+
+  malloc_stats_a();
+
+  printf("stats_a test complete\n");
+}
+
+/*
+ * Sums up a timing histogram of stats_a()
+ */
+static size_t timing_total(const size_t *hist) {
+  size_t total = 0;
+
+  for (int i = 0; i < TIMING_BUCKETS_A; i++)
+    total += hist[i];
+  return total;
+}
+
+void test_timing(void) {
+  alloc_stats_t before, after;
+
+  printf("Test: lock and latency histograms\n");
+
+  stats_a(&before);
+  for (int i = 0; i < 100; i++)
+    free_a(malloc_a(i < 50 ? 64 : 4096));
+  stats_a(&after);
+
+  size_t mallocs =
+      timing_total(after.malloc_ns) - timing_total(before.malloc_ns);
+  size_t frees = timing_total(after.free_ns) - timing_total(before.free_ns);
+#ifdef ALLOCATOR_TIMING
+  printf("calls timed: %s\n", mallocs >= 100 && frees >= 100 ? "all" : "some");
+  printf("lock waits timed: %s\n",
+         timing_total(after.lock_wait_ns) > timing_total(before.lock_wait_ns)
+             ? "yes"
+             : "no");
+
+  /* Every hold is attributed to one operation, and the shared pool blocks
+   * are taken and given back under the lock */
+  size_t split = 0;
+  for (int op = 0; op < LOCK_OPS_A; op++)
+    split += timing_total(after.lock_hold_op_ns[op]);
+  printf("lock holds split by operation: %s\n",
+         split == timing_total(after.lock_hold_ns) &&
+                 timing_total(after.lock_hold_op_ns[LOCK_OP_MALLOC_A]) >
+                     timing_total(before.lock_hold_op_ns[LOCK_OP_MALLOC_A]) &&
+                 timing_total(after.lock_hold_op_ns[LOCK_OP_FREE_A]) >
+                     timing_total(before.lock_hold_op_ns[LOCK_OP_FREE_A])
+             ? "yes"
+             : "no");
+#else
+  printf("histograms %s without ALLOCATOR_TIMING\n",
+         mallocs || frees ? "filled" : "empty");
+#endif
+  printf("timing test complete\n");
+}
+
+void test_coalescing(void) {
+  printf("Test: coalescing of adjacent free blocks\n");
+
+  char *a = malloc_a(5000), *b = malloc_a(5000), *c = malloc_a(5000);
+  void *guard = malloc_a(5000);
+  if (!a || !b || !c || !guard) {
+    printf("malloc_a failed\n");
+    return;
+  }
+
+  /* Blocks carved one after the other are equally spaced */
+  int adjacent = b - a == c - b && b - a > 5000 && b - a < 5100;
+  printf("blocks adjacent: %s\n", adjacent ? "yes" : "no");
+
+  alloc_stats_t before, after;
+  stats_a(&before);
+
+  /* Freeing the middle block last merges it with both neighbours */
+  free_a(a);
+  free_a(c);
+  free_a(b);
+  stats_a(&after);
+  printf("free blocks after freeing three neighbours: %zu\n",
+         after.free_blocks_large - before.free_blocks_large);
+
+  free_a(guard);
+  printf("coalescing test complete\n");
+}
+
+Node *arena_allocate_tree(arena_t *arena, int depth, int start_value) {
+  if (depth <= 0)
+    return NULL;
+
+  Node *node = arena_alloc_a(arena, sizeof(Node));
+  if (!node) {
+    printf("Arena allocation failed at depth %d\n", depth);
+    return NULL;
+  }
+
+  node->value = start_value;
+  memset(node->padding, 0xAB, sizeof(node->padding));
+
+  node->left = arena_allocate_tree(arena, depth - 1, start_value * 2);
+  node->right = arena_allocate_tree(arena, depth - 1, start_value * 2 + 1);
+
+  return node;
+}
+
+int count_tree(Node *node) {
+  if (!node)
+    return 0;
+  return 1 + count_tree(node->left) + count_tree(node->right);
+}
+
+void test_arena_a(void) {
+  printf("Test: arena_a bulk allocation\n");
+
+  arena_t *arena = arena_create_a();
+  if (!arena) {
+    printf("arena_create_a failed\n");
+    return;
+  }
+
+  /* Deep enough to spill over into a second chunk */
+  Node *root = arena_allocate_tree(arena, 17, 1);
+  if (!root) {
+    printf("arena tree allocation failed\n");
+    return;
+  }
+  printf("arena tree of %d nodes, root value %d\n", count_tree(root),
+         root->value);
+
+  arena_reset_a(arena);
+
+  root = arena_allocate_tree(arena, 17, 2);
+  if (!root) {
+    printf("arena tree allocation after reset failed\n");
+    return;
+  }
+  printf("arena tree after reset of %d nodes, root value %d\n",
+         count_tree(root), root->value);
+
+  char *big = arena_alloc_a(arena, 8 * 1024 * 1024);
+  if (!big) {
+    printf("large arena allocation failed\n");
+    return;
+  }
+  memset(big, 0xEF, 8 * 1024 * 1024);
+
+  arena_destroy_a(arena);
+
+  printf("arena_a test complete\n");
+}
+
+Node *pool_allocate_tree(pool_t *pool, int depth, int start_value) {
+  if (depth <= 0)
+    return NULL;
+
+  Node *node = pool_alloc_a(pool);
+  if (!node) {
+    printf("Pool allocation failed at depth %d\n", depth);
+    return NULL;
+  }
+
+  node->value = start_value;
+  memset(node->padding, 0xAB, sizeof(node->padding));
+
+  node->left = pool_allocate_tree(pool, depth - 1, start_value * 2);
+  node->right = pool_allocate_tree(pool, depth - 1, start_value * 2 + 1);
+
+  return node;
+}
+
+void pool_free_tree(pool_t *pool, Node *node) {
+  if (!node)
+    return;
+
+  pool_free_tree(pool, node->left);
+  pool_free_tree(pool, node->right);
+  pool_free_a(pool, node);
+}
+
+void test_pool_a(void) {
+  printf("Test: pool_a fixed-size objects\n");
+
+  pool_t *pool = pool_create_a(sizeof(Node), 64);
+  if (!pool) {
+    printf("pool_create_a failed\n");
+    return;
+  }
+
+  Node *root = pool_allocate_tree(pool, 12, 1);
+  if (!root) {
+    printf("pool tree allocation failed\n");
+    return;
+  }
+  printf("pool tree of %d nodes, root value %d, root %s aligned\n",
+         count_tree(root), root->value,
+         (size_t)root % 64 ? "not" : "cache line");
+
+  pool_free_tree(pool, root);
+
+  /* Freed nodes are handed out again */
+  root = pool_allocate_tree(pool, 12, 2);
+  if (!root) {
+    printf("pool tree allocation after free failed\n");
+    return;
+  }
+  printf("pool tree after free of %d nodes, root value %d\n",
+         count_tree(root), root->value);
+  pool_free_tree(pool, root);
+
+  /* Objects are packed at their size rounded up to the alignment, so a 4 MiB
+   * chunk holds close to 262144 objects of 16 bytes */
+  static const size_t packings[][3] = {{16, 0, 16}, {24, 0, 32}, {40, 8, 40}};
+  for (size_t i = 0; i < sizeof(packings) / sizeof(packings[0]); i++) {
+    enum { COUNT = 300000 };
+    pool_t *packed = pool_create_a(packings[i][0], packings[i][1]);
+    void **objs = malloc(COUNT * sizeof(void *));
+    size_t run = 1, per_chunk = 0;
+    int ok = packed && objs;
+
+    for (size_t j = 0; ok && j < COUNT; j++)
+      ok = (objs[j] = pool_alloc_a(packed)) != NULL;
+    if (!ok) {
+      printf("pool of %zu byte objects failed\n", packings[i][0]);
+      free(objs);
+      continue;
+    }
+
+    /* Objects of a magazine batch are neighbours */
+    uintptr_t first = (uintptr_t)objs[0], second = (uintptr_t)objs[1];
+    size_t stride = first > second ? first - second : second - first;
+
+    /* Chunks are carved in order, so their objects come in runs */
+    for (size_t j = 1; j < COUNT; j++) {
+      run = ((uintptr_t)objs[j] ^ (uintptr_t)objs[j - 1]) >> 22 ? 1 : run + 1;
+      if (run > per_chunk)
+        per_chunk = run;
+    }
+    printf("pool of %zu byte objects: stride %s, %s objects per chunk\n",
+           packings[i][0], stride == packings[i][2] ? "packed" : "wrong",
+           per_chunk >= (4 << 20) / packings[i][2] * 99 / 100 ? "enough"
+                                                                : "too few");
+
+    for (size_t j = 0; j < COUNT; j++)
+      pool_free_a(packed, objs[j]);
+    free(objs);
+  }
+
+  /* Each pool has a magazine of its own, so interleaved pools hand back the
+   * object freed to them last */
+  enum { POOLS = 20 };
+  pool_t *pools[POOLS];
+  void *last[POOLS];
+  int kept = 1;
+  for (int i = 0; i < POOLS; i++) {
+    pools[i] = pool_create_a(32, 0);
+    if (!pools[i]) {
+      printf("pool_create_a failed\n");
+      return;
+    }
+    last[i] = pool_alloc_a(pools[i]);
+  }
+  for (int round = 0; round < 4; round++) {
+    for (int i = 0; i < POOLS; i++)
+      pool_free_a(pools[i], last[i]);
+    for (int i = 0; i < POOLS; i++) {
+      void *obj = pool_alloc_a(pools[i]);
+      kept &= obj == last[i];
+      last[i] = obj;
+    }
+  }
+  printf("interleaved pools %s their magazines\n", kept ? "keep" : "share");
+
+  /* Destroying a pool unmaps its chunks and drops the objects its magazines
+   * held, which a pool taking over its id must not hand out */
+  alloc_stats_t before, after;
+  enum { OBJS = 300000 };
+  void **objs = malloc(OBJS * sizeof(void *));
+  pool_t *doomed = pool_create_a(16, 0);
+  size_t allocated = 0;
+  while (objs && doomed && allocated < OBJS &&
+         (objs[allocated] = pool_alloc_a(doomed)))
+    allocated++;
+  for (size_t j = allocated > 10 ? allocated - 10 : 0; j < allocated; j++)
+    pool_free_a(doomed, objs[j]);
+  free(objs);
+  stats_a(&before);
+  if (doomed)
+    pool_destroy_a(doomed);
+  stats_a(&after);
+  printf("pool_destroy_a %s its chunks\n",
+         before.bytes_mapped - after.bytes_mapped >= 2 * (4 << 20)
+             ? "unmapped"
+             : "kept");
+
+  pool_t *reborn = pool_create_a(16, 0);
+  void *obj = reborn ? pool_alloc_a(reborn) : NULL;
+  printf("new pool object %s\n",
+         (char *)obj > (char *)reborn && (char *)obj - (char *)reborn < 4096
+             ? "carved anew"
+             : "stale");
+  if (reborn) {
+    pool_free_a(reborn, obj);
+    pool_destroy_a(reborn);
+  }
+  for (int i = 0; i < POOLS; i++) {
+    pool_free_a(pools[i], last[i]);
+    pool_destroy_a(pools[i]);
+  }
+
+  printf("pool_a test complete\n");
+}
+
+void test_huge_pages(void) {
+  alloc_stats_t before, after;
+  int failed = 0;
+
+  printf("Test: huge page backed arenas\n");
+
+  for (int mode = HUGEPAGES_OFF_A; mode <= HUGEPAGES_HUGETLB_A; mode++) {
+    mallopt_a(M_HUGEPAGES_A, (size_t)mode);
+
+    stats_a(&before);
+    arena_t *arena = arena_create_a();
+    if (!arena) {
+      printf("arena_create_a failed\n");
+      failed = 1;
+      break;
+    }
+    Node *root = arena_allocate_tree(arena, 14, 1);
+    stats_a(&after);
+
+    /* Every chunk the arena mapped is flagged as asked: none is huge without
+     * huge pages, each is advised for THP, and under MAP_HUGETLB each is
+     * either mapped from the reserved pages or counted as a fallback and
+     * advised for THP instead */
+    size_t chunks = (after.bytes_mapped - before.bytes_mapped) / (4 << 20);
+    size_t hugetlb = after.hugetlb_chunks - before.hugetlb_chunks;
+    size_t thp = after.thp_chunks - before.thp_chunks;
+    size_t fallbacks = after.hugetlb_fallbacks - before.hugetlb_fallbacks;
+    int ok = root && count_tree(root) == (1 << 14) - 1 && chunks;
+
+    if (mode == HUGEPAGES_OFF_A)
+      ok &= !hugetlb && !thp && !fallbacks;
+    else if (mode == HUGEPAGES_THP_A)
+      ok &= !hugetlb && thp == chunks && !fallbacks;
+    else
+      ok &= hugetlb + thp == chunks && thp == fallbacks &&
+            huge_pages_a() >= hugetlb * 2;
+    printf("huge page mode %d: %s\n", mode, ok ? "pass" : "fail");
+    failed |= !ok;
+
+    arena_destroy_a(arena);
+    stats_a(&after);
+    if (after.hugetlb_chunks != before.hugetlb_chunks ||
+        after.thp_chunks != before.thp_chunks) {
+      printf("huge page mode %d: huge chunks left after destroy\n", mode);
+      failed = 1;
+    }
+  }
+
+  mallopt_a(M_HUGEPAGES_A, HUGEPAGES_OFF_A);
+  printf("huge page test %s\n", failed ? "failed" : "complete");
+}
+
+void test_malloc_node_a(void) {
+  static const size_t sizes[] = {24, 1000, 5000, 2 << 20};
+  int ok = 1;
+
+  printf("Test: malloc_node_a\n");
+
+  /* Node 0 exists on every machine */
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    char *block = malloc_node_a(sizes[s], 0);
+    if (!block) {
+      ok = 0;
+      continue;
+    }
+    memset(block, 1, sizes[s]);
+    block = realloc_a(block, sizes[s] * 2);
+    ok &= block && block[sizes[s] - 1] == 1;
+    free_a(block);
+  }
+  printf("allocations on node 0 %s\n", ok ? "succeeded" : "failed");
+
+  /* Requests below the mmap threshold are carved from chunks of the node
+   * instead of mapping each block */
+  alloc_stats_t before, after;
+  void *medium[100];
+  stats_a(&before);
+  for (int i = 0; i < 100; i++)
+    medium[i] = malloc_node_a(5000 + (size_t)i * 100, 0);
+  for (int i = 0; i < 100; i++)
+    free_a(medium[i]);
+  stats_a(&after);
+  printf("medium blocks on node 0 %s\n",
+         after.mmap_count - before.mmap_count < 10 ? "share chunks"
+                                                   : "are mapped");
+
+  printf("invalid nodes %s\n",
+         malloc_node_a(64, -1) || malloc_node_a(64, 1 << 20) ? "accepted"
+                                                              : "rejected");
+  printf("malloc_node_a test complete\n");
+}
+
+#define BATCH_SIZE 100
+
+void test_batch_a(void) {
+  static const size_t sizes[] = {24, 4000, 2 * 1024 * 1024};
+  void *blocks[BATCH_SIZE + 1];
+
+  printf("Test: malloc_batch_a/free_batch_a\n");
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t n = malloc_batch_a(sizes[s], BATCH_SIZE, blocks);
+    if (n != BATCH_SIZE) {
+      printf("malloc_batch_a(%zu) returned %zu blocks\n", sizes[s], n);
+      free_batch_a(blocks, n);
+      return;
+    }
+
+    for (size_t i = 0; i < n; i++)
+      memset(blocks[i], (int)i, sizes[s]);
+    for (size_t i = 0; i < n; i++) {
+      if (((unsigned char *)blocks[i])[sizes[s] - 1] != (unsigned char)i) {
+        printf("batch block %zu of size %zu overlaps\n", i, sizes[s]);
+        return;
+      }
+    }
+
+    /* NULL entries are skipped */
+    blocks[n] = NULL;
+    free_batch_a(blocks, n + 1);
+    printf("batch of %zu blocks of %zu bytes\n", n, sizes[s]);
+  }
+
+  printf("batch test complete\n");
+}
+
+void test_aligned_a(void) {
+  static const size_t sizes[] = {24, 100, 1000, 5000, 100000, 3 << 20};
+  int misaligned = 0, count = 0;
+
+  printf("Test: aligned_alloc_a/posix_memalign_a\n");
+
+  for (size_t align = 32; align <= 16 << 20; align <<= 1) {
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+      char *block = aligned_alloc_a(align, sizes[s]);
+      if (!block) {
+        printf("aligned_alloc_a(%zu, %zu) failed\n", align, sizes[s]);
+        return;
+      }
+      misaligned += (size_t)block % align != 0;
+      if (malloc_usable_size_a(block) < sizes[s]) {
+        printf("aligned_alloc_a(%zu, %zu) block too small\n", align, sizes[s]);
+        return;
+      }
+      memset(block, 0x5a, sizes[s]);
+
+      /* Resizing keeps the contents */
+      block = realloc_a(block, sizes[s] * 2);
+      if (!block || block[sizes[s] - 1] != 0x5a) {
+        printf("realloc_a of aligned block failed\n");
+        return;
+      }
+      free_a(block);
+      count++;
+    }
+  }
+  printf("%d aligned blocks, %d misaligned\n", count, misaligned);
+
+  void *block = NULL;
+  printf("posix_memalign_a(24) returns %s\n",
+         posix_memalign_a(&block, 24, 64) == EINVAL ? "EINVAL" : "success");
+  if (!posix_memalign_a(&block, 4096, 64)) {
+    printf("posix_memalign_a(4096) %s aligned\n",
+           (size_t)block % 4096 ? "not" : "page");
+    free_a(block);
+  }
+  if (!posix_memalign_a(&block, 8 << 20, 64)) {
+    printf("posix_memalign_a(8 MiB) %s aligned\n",
+           (size_t)block % (8 << 20) ? "not" : "8 MiB");
+    free_a(block);
+  }
+
+  printf("aligned test complete\n");
+}
+
+static pthread_key_t late_key;
+static int late_freed;
+
+/*
+ * @brief Destructor of a key created after the allocator's, so it runs once
+ * the thread's heap is gone and small requests come from the shared pool
+ */
+static void late_destructor(void *arg) {
+  (void)arg;
+  for (int i = 0; i < 100; i++) {
+    void *block = malloc_a(32);
+
+    if (!block)
+      return;
+    free_sized_a(block, 32);
+  }
+  late_freed = 1;
+}
+
+static void *late_thread_func(void *arg) {
+  (void)arg;
+  free_a(malloc_a(16));
+  pthread_setspecific(late_key, &late_key);
+  return NULL;
+}
+
+void test_free_sized_a(void) {
+  static const size_t sizes[] = {8, 100, 1024, 1025, 50000, 2 << 20};
+  alloc_stats_t before, after;
+
+  printf("Test: free_sized_a\n");
+
+  stats_a(&before);
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    void *block = malloc_a(sizes[s]);
+    if (!block) {
+      printf("malloc_a(%zu) failed\n", sizes[s]);
+      return;
+    }
+    free_sized_a(block, sizes[s]);
+  }
+
+  /* Shrinking and growing across size classes keeps the size usable */
+  char *block = malloc_a(4000);
+  block = realloc_a(block, 100);
+  block = realloc_a(block, 300);
+  if (!block) {
+    printf("realloc_a failed\n");
+    return;
+  }
+  free_sized_a(block, 300);
+
+  /* Over-aligned objects come from a larger class than their size */
+  void *aligned = aligned_alloc_a(64, 48);
+  if (!aligned) {
+    printf("aligned_alloc_a failed\n");
+    return;
+  }
+  free_sized_a(aligned, 48);
+
+  /* Frees in a destructor running after the thread's heap was abandoned */
+  pthread_t thread;
+  pthread_key_create(&late_key, late_destructor);
+  pthread_create(&thread, NULL, late_thread_func, NULL);
+  pthread_join(thread, NULL);
+  pthread_key_delete(late_key);
+  printf("sized free without a heap %s\n", late_freed ? "done" : "failed");
+
+  stats_a(&after);
+  printf("bytes in use %s\n",
+         after.bytes_in_use == before.bytes_in_use ? "unchanged" : "changed");
+  printf("free_sized_a test complete\n");
+}
+
+void test_good_size_a(void) {
+  static const size_t sizes[] = {1, 17, 100, 1024, 1025, 5000, 1 << 20,
+                                 (1 << 20) + 1, 3 << 20};
+  int ok = 1;
+
+  printf("Test: good_size_a\n");
+
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t good = good_size_a(sizes[s]);
+    void *block = malloc_a(sizes[s]);
+
+    if (!block) {
+      printf("malloc_a(%zu) failed\n", sizes[s]);
+      return;
+    }
+    /* Rounding is stable, and the block holds the rounded size */
+    if (good < sizes[s] || good_size_a(good) != good ||
+        malloc_usable_size_a(block) < good) {
+      printf("size %zu: good %zu, usable %zu\n", sizes[s], good,
+             malloc_usable_size_a(block));
+      ok = 0;
+    }
+    free_a(block);
+  }
+  printf("good_size_a %s\n", ok ? "consistent" : "inconsistent");
+  printf("good_size_a(0) %zu, good_size_a(SIZE_MAX) %zu\n", good_size_a(0),
+         good_size_a(SIZE_MAX));
+
+  /* A buffer grown to the capacity it gets reallocates less often */
+  size_t capacity = 0, reallocs = 0;
+  char *buffer = NULL;
+  for (size_t length = 1; length <= 4096; length++) {
+    if (length > capacity) {
+      buffer = realloc_a(buffer, good_size_a(length * 2));
+      if (!buffer) {
+        printf("realloc_a failed\n");
+        return;
+      }
+      capacity = malloc_usable_size_a(buffer);
+      reallocs++;
+    }
+    buffer[length - 1] = (char)length;
+  }
+  free_a(buffer);
+  printf("%zu reallocs for 4096 appends\n", reallocs);
+  printf("good_size_a test complete\n");
+}
+
 #define NUM_THREADS 4
 #define TREE_DEPTH 3
 
@@ -122,6 +893,168 @@ void *thread_func(void *arg) {
   return NULL;
 }
 
+/*
+ * Dumps the heap profile and reads back its totals
+ */
+static int read_profile(size_t *objects, size_t *bytes) {
+  FILE *file = tmpfile();
+  char line[256];
+  int ok;
+
+  if (!file)
+    return 0;
+  ok = !profile_dump_a(fileno(file)) && !fseek(file, 0, SEEK_SET) &&
+       fgets(line, sizeof(line), file) &&
+       sscanf(line, "heap profile: %zu: %zu", objects, bytes) == 2 &&
+       strstr(line, "@ heap_v2/1\n");
+  fclose(file);
+  return ok;
+}
+
+void test_profile(void) {
+  void *blocks[12];
+  size_t objects = 0, bytes = 0;
+  char name[64];
+
+  printf("Test: sampling heap profiler\n");
+
+  /* A mean of one byte between samples records every allocation */
+  mallopt_a(M_PROFILE_A, 1);
+  for (int i = 0; i < 12; i++)
+    blocks[i] = malloc_a(i < 8 ? 100 : 50000);
+
+  if (!read_profile(&objects, &bytes))
+    printf("profile unreadable\n");
+  printf("sampled %zu objects of %zu bytes\n", objects, bytes);
+
+  for (int i = 0; i < 12; i++)
+    free_a(blocks[i]);
+  mallopt_a(M_PROFILE_A, 0);
+
+  if (!read_profile(&objects, &bytes))
+    printf("profile unreadable\n");
+  printf("%zu objects left after freeing\n", objects);
+
+  mallopt_a(M_PROFILE_SIGNAL_A, SIGUSR1);
+  raise(SIGUSR1);
+  mallopt_a(M_PROFILE_SIGNAL_A, 0);
+  snprintf(name, sizeof(name), "heap.%d.0.prof", (int)getpid());
+  printf("profile written on signal: %s\n", unlink(name) ? "no" : "yes");
+
+  printf("heap profiler test complete\n");
+}
+
+static uint64_t trace_varint(FILE *file) {
+  uint64_t value = 0;
+  int shift = 0, byte;
+
+  while ((byte = fgetc(file)) != EOF) {
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80))
+      break;
+    shift += 7;
+  }
+  return value;
+}
+
+/*
+ * @brief Counts the events of a trace by kind, and the threads recording them
+ *
+ * @return 1 if the trace was decoded, 0 otherwise
+ */
+static int read_trace(FILE *file, size_t counts[7], size_t *threads) {
+  static const int fields[7] = {0, 2, 2, 3, 3, 1, 2};
+  uint32_t block[2], seen[64];
+  char magic[8];
+
+  *threads = 0;
+  if (fseek(file, 0, SEEK_SET) || fread(magic, 8, 1, file) != 1 ||
+      memcmp(magic, TRACE_MAGIC_A, 8))
+    return 0;
+
+  while (fread(block, sizeof(block), 1, file) == 1) {
+    long end = ftell(file) + (long)block[1];
+    size_t t;
+
+    for (t = 0; t < *threads && seen[t] != block[0]; t++)
+      ;
+    if (t == *threads && *threads < 64)
+      seen[(*threads)++] = block[0];
+
+    while (ftell(file) < end) {
+      int op = fgetc(file);
+
+      if (op < TRACE_MALLOC_A || op > TRACE_FREE_SIZED_A)
+        return 0;
+      counts[op]++;
+      trace_varint(file);
+      for (int f = 0; f < fields[op]; f++)
+        trace_varint(file);
+    }
+  }
+  return 1;
+}
+
+static void *trace_thread_func(void *arg) {
+  void **blocks = arg;
+
+  for (int i = 0; i < 10; i++)
+    blocks[i] = malloc_a(64);
+  return NULL;
+}
+
+void test_trace(void) {
+  size_t counts[7] = {0}, threads;
+  void *blocks[10];
+  pthread_t thread;
+  FILE *file = tmpfile();
+  pid_t pid;
+
+  printf("Test: allocation trace\n");
+
+  if (!file || trace_start_a(fileno(file))) {
+    printf("trace not started\n");
+    return;
+  }
+  printf("second trace %s\n",
+         trace_start_a(fileno(file)) ? "refused" : "started");
+
+  char *block = malloc_a(100);
+  void *zeroed = calloc_a(4, 25);
+  void *aligned = aligned_alloc_a(64, 200);
+  block = realloc_a(block, 5000);
+  free_a(block);
+  free_sized_a(zeroed, 100);
+  free_a(aligned);
+
+  /* Blocks of an exited thread, freed by this one */
+  pthread_create(&thread, NULL, trace_thread_func, blocks);
+  pthread_join(thread, NULL);
+  free_batch_a(blocks, 10);
+
+  /* A child does not write to its parent's trace */
+  pid = fork();
+  if (pid == 0) {
+    for (int i = 0; i < 100; i++)
+      free_a(malloc_a(32));
+    _exit(0);
+  }
+  waitpid(pid, NULL, 0);
+
+  printf("trace stopped %s\n", trace_stop_a() ? "no" : "yes");
+  printf("second stop %s\n", trace_stop_a() ? "refused" : "accepted");
+
+  if (!read_trace(file, counts, &threads))
+    printf("trace unreadable\n");
+  printf("%zu malloc, %zu calloc, %zu aligned, %zu realloc, %zu free, %zu "
+         "sized free in %zu threads\n",
+         counts[TRACE_MALLOC_A], counts[TRACE_CALLOC_A],
+         counts[TRACE_ALIGNED_A], counts[TRACE_REALLOC_A],
+         counts[TRACE_FREE_A], counts[TRACE_FREE_SIZED_A], threads);
+  fclose(file);
+  printf("allocation trace test complete\n");
+}
+
 void test_multithreaded(void) {
   pthread_t threads[NUM_THREADS];
   int thread_ids[NUM_THREADS];
@@ -200,37 +1133,193 @@ void test_multithreaded_free(void) {
   printf("multithreaded free test complete\n");
 }
 
-#define elapsed_ms(start, end)                                                 \
-  (end.tv_sec - start.tv_sec) * 1000.0 +                                       \
-      (end.tv_nsec - start.tv_nsec) / 1000000.0
+#define FORK_THREADS 4
+#define FORK_ROUNDS 20
 
-int main() {
-  struct timespec start, end;
+static volatile int fork_test_done;
+static pool_t *fork_pool;
 
-  clock_gettime(CLOCK_MONOTONIC, &start);
-  test_binary_tree(4);
-  clock_gettime(CLOCK_MONOTONIC, &end);
-  printf("test_binary_tree(4) took %.3f ms\n\n", elapsed_ms(start, end));
+void *fork_test_thread_func(void *arg) {
+  (void)arg;
+  while (!fork_test_done) {
+    void *block = malloc_a(64);
+    void *large = malloc_a(8000);
+    void *obj = pool_alloc_a(fork_pool);
+    free_a(block);
+    free_a(large);
+    pool_free_a(fork_pool, obj);
+  }
+  return NULL;
+}
 
-  clock_gettime(CLOCK_MONOTONIC, &start);
-  test_calloc_a_array(100, sizeof(int));
-  clock_gettime(CLOCK_MONOTONIC, &end);
-  printf("test_calloc_a_array took %.3f ms\n\n", elapsed_ms(start, end));
+void *fork_child_thread_func(void *arg) {
+  (void)arg;
+  for (int i = 0; i < 1000; i++) {
+    void *block = malloc_a(64);
+    void *obj = pool_alloc_a(fork_pool);
+    free_a(block);
+    pool_free_a(fork_pool, obj);
+  }
+  return NULL;
+}
 
-  clock_gettime(CLOCK_MONOTONIC, &start);
-  test_realloc_a();
-  clock_gettime(CLOCK_MONOTONIC, &end);
-  printf("test_realloc_a took %.3f ms\n\n", elapsed_ms(start, end));
+void test_fork(void) {
+  pthread_t threads[FORK_THREADS];
+  int ok = 0;
 
-  clock_gettime(CLOCK_MONOTONIC, &start);
-  test_multithreaded();
-  clock_gettime(CLOCK_MONOTONIC, &end);
-  printf("test_multithreaded took %.3f ms\n\n", elapsed_ms(start, end));
+  printf("Test: fork while other threads allocate\n");
+
+  fork_pool = pool_create_a(48, 0);
+  if (!fork_pool) {
+    printf("pool_create_a failed\n");
+    return;
+  }
+
+  fork_test_done = 0;
+  for (int i = 0; i < FORK_THREADS; i++)
+    pthread_create(&threads[i], NULL, fork_test_thread_func, NULL);
+
+  for (int i = 0; i < FORK_ROUNDS; i++) {
+    int status;
+    pid_t pid = fork();
+
+    if (pid == 0) {
+      alloc_stats_t stats;
+
+      /* A lock inherited locked would hang the child */
+      alarm(5);
+      free_a(malloc_a(64));
+      free_a(malloc_a(8000));
+      pool_free_a(fork_pool, pool_alloc_a(fork_pool));
+
+      /* Only the forking thread's heap is left */
+      stats_a(&stats);
+      if (stats.threads > 1)
+        _exit(1);
+
+      /* A new thread gets a fresh heap, not one of a thread fork() cut off
+       * mid-update */
+      pthread_t thread;
+      pthread_create(&thread, NULL, fork_child_thread_func, NULL);
+      pthread_join(thread, NULL);
+      free_a(malloc_a(64));
+      _exit(0);
+    }
+    if (pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+        WEXITSTATUS(status) == 0)
+      ok++;
+  }
+
+  fork_test_done = 1;
+  for (int i = 0; i < FORK_THREADS; i++)
+    pthread_join(threads[i], NULL);
+
+  printf("%d of %d children ran to completion\n", ok, FORK_ROUNDS);
+  printf("fork test complete\n");
+}
+
+/*
+ * Blocks the destructor below frees, set in a child process only
+ */
+static void *exit_blocks[3];
+static pool_t *exit_pool;
+
+/*
+ * @brief Frees blocks like a library destructor running after the
+ * allocator's exit handler, which atexit() registered later
+ */
+__attribute__((destructor)) static void exit_destructor(void) {
+  if (!exit_pool)
+    return;
+  free_a(exit_blocks[0]);
+  free_a(exit_blocks[1]);
+  pool_free_a(exit_pool, exit_blocks[2]);
+  free_a(malloc_a(5000));
+}
+
+void test_exit_default(void) {
+  int status = 0;
+  pid_t pid;
+
+  printf("Test: frees after the exit handler\n");
+
+  /* Memory is left to the OS by default, so blocks freed by later
+   * destructors are still mapped */
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) {
+    exit_blocks[0] = malloc_a(32);
+    exit_blocks[1] = malloc_a(5000);
+    exit_pool = pool_create_a(48, 0);
+    exit_blocks[2] = exit_pool ? pool_alloc_a(exit_pool) : NULL;
+    exit(0);
+  }
+  waitpid(pid, &status, 0);
+  printf("process %s\n", WIFEXITED(status) && !WEXITSTATUS(status)
+                              ? "exited cleanly"
+                              : "crashed");
+  printf("exit test complete\n");
+}
+
+void test_exit_leak_report(void) {
+  char report[512] = "";
+  int fds[2];
+  pid_t pid;
+
+  printf("Test: leak report at exit\n");
+
+  if (pipe(fds))
+    return;
 
-  clock_gettime(CLOCK_MONOTONIC, &start);
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) {
+    dup2(fds[1], 2);
+    mallopt_a(M_EXIT_CLEANUP_A, EXIT_LEAK_REPORT_A);
+    for (int i = 0; i < 10; i++)
+      malloc_a(5000);
+    exit(0);
+  }
+
+  close(fds[1]);
+  if (read(fds[0], report, sizeof(report) - 1) < 0)
+    report[0] = '\0';
+  close(fds[0]);
+  waitpid(pid, NULL, 0);
+
+  fputs(report, stdout);
+  printf("leak report %s\n",
+         strstr(report, "in 10 blocks") ? "lists the leaked blocks"
+                                        : "is missing");
+  printf("leak report test complete\n");
+}
+
+int main() {
+  test_binary_tree(4);
+  test_calloc_a_array(100, sizeof(int));
+  test_realloc_a();
+  test_realloc_a_large();
+  test_realloc_a_in_place();
+  test_large_cache();
+  test_trim_a();
+  test_stats_a();
+  test_coalescing();
+  test_timing();
+  test_arena_a();
+  test_pool_a();
+  test_huge_pages();
+  test_malloc_node_a();
+  test_batch_a();
+  test_aligned_a();
+  test_free_sized_a();
+  test_good_size_a();
+  test_profile();
+  test_trace();
+  test_fork();
+  test_exit_default();
+  test_exit_leak_report();
+  test_multithreaded();
   test_multithreaded_free();
-  clock_gettime(CLOCK_MONOTONIC, &end);
-  printf("test_multithreaded_free took %.3f ms\n\n", elapsed_ms(start, end));
 
   return 0;
 }
@@ -0,0 +1,173 @@
+#define ALLOCATOR_GLOBAL_NEW
+#include "allocator.hpp"
+
+#include <cstdio>
+#include <list>
+#include <map>
+#include <memory>
+#include <memory_resource>
+#include <pthread.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct alignas(64) Line {
+  char bytes[64];
+};
+
+/*
+ * @brief Returns the number of malloc_a calls and of frees so far
+ */
+static void call_counts(size_t *mallocs, size_t *frees) {
+  alloc_stats_t stats;
+
+  stats_a(&stats);
+  *mallocs = stats.malloc_count;
+  *frees = stats.free_count;
+}
+
+void test_stl_allocator() {
+  printf("Test: stl_allocator\n");
+
+  std::vector<int, allocator_a::stl_allocator<int>> numbers;
+  for (int i = 0; i < 100000; i++)
+    numbers.push_back(i);
+
+  long long sum = 0;
+  for (int number : numbers)
+    sum += number;
+  printf("sum %lld\n", sum);
+
+  std::vector<Line, allocator_a::stl_allocator<Line>> lines(10);
+  printf("over-aligned elements %s\n",
+         reinterpret_cast<uintptr_t>(lines.data()) % alignof(Line)
+             ? "misaligned"
+             : "aligned");
+  printf("stl_allocator test complete\n");
+}
+
+void test_pool_allocator() {
+  printf("Test: pool_allocator\n");
+
+  std::map<int, int, std::less<int>,
+           allocator_a::pool_allocator<std::pair<const int, int>>>
+      squares;
+  for (int i = 0; i < 10000; i++)
+    squares[i] = i * i;
+  for (int i = 0; i < 10000; i += 2)
+    squares.erase(i);
+  printf("%zu squares, 99 squared %d\n", squares.size(), squares[99]);
+
+  std::list<std::string, allocator_a::pool_allocator<std::string>> words;
+  for (int i = 0; i < 1000; i++)
+    words.push_back(std::to_string(i));
+  printf("%zu words, last %s\n", words.size(), words.back().c_str());
+  printf("pool_allocator test complete\n");
+}
+
+void test_memory_resources() {
+  printf("Test: memory resources\n");
+
+  std::pmr::vector<std::pmr::string> heap_strings(allocator_a::heap_resource());
+  for (int i = 0; i < 1000; i++)
+    heap_strings.emplace_back(std::string(100, 'a' + i % 26));
+  printf("heap resource: %zu strings\n", heap_strings.size());
+
+  /* The standard pool resources can draw from the heap resource */
+  std::pmr::unsynchronized_pool_resource pools(allocator_a::heap_resource());
+  std::pmr::list<int> pooled(&pools);
+  for (int i = 0; i < 1000; i++)
+    pooled.push_back(i);
+  printf("pool resource: %zu nodes\n", pooled.size());
+
+  allocator_a::arena_resource arena;
+  for (int round = 0; round < 3; round++) {
+    {
+      std::pmr::vector<int> scratch(&arena);
+      for (int i = 0; i < 10000; i++)
+        scratch.push_back(i);
+      void *line = arena.allocate(sizeof(Line), alignof(Line));
+      if (reinterpret_cast<uintptr_t>(line) % alignof(Line))
+        printf("arena resource: misaligned block\n");
+    }
+    arena.release();
+  }
+  printf("arena resource: 3 rounds released\n");
+  printf("memory resources test complete\n");
+}
+
+static pthread_key_t late_key;
+static bool late_deleted;
+
+/*
+ * @brief Destructor of a key created after the allocator's, so it runs once
+ * the thread's heap is gone and small requests come from the shared pool
+ */
+static void late_destructor(void *) {
+  for (int i = 0; i < 100; i++) {
+    /* Sized delete of a complete type */
+    delete new Line;
+    delete new std::pair<long, long>(1, 2);
+    delete[] new std::pair<long, long>[3];
+
+    allocator_a::stl_allocator<int> ints;
+    ints.deallocate(ints.allocate(5), 5);
+
+    std::pmr::memory_resource *heap = allocator_a::heap_resource();
+    heap->deallocate(heap->allocate(24), 24);
+  }
+  late_deleted = true;
+}
+
+void test_global_new() {
+  size_t mallocs_before, frees_before, mallocs_after, frees_after;
+
+  printf("Test: global operator new\n");
+
+  call_counts(&mallocs_before, &frees_before);
+  delete new int(1);
+  delete[] new char[100];
+  auto shared = std::make_shared<std::string>(1000, 'x');
+  shared.reset();
+  call_counts(&mallocs_after, &frees_after);
+  printf("new and delete %s the allocator\n",
+         mallocs_after - mallocs_before >= 3 &&
+                 frees_after - frees_before >= 3
+             ? "use"
+             : "bypass");
+
+  Line *line = new Line;
+  printf("over-aligned new %s\n",
+         reinterpret_cast<uintptr_t>(line) % alignof(Line) ? "misaligned"
+                                                           : "aligned");
+  delete line;
+
+  int *none = new (std::nothrow) int[0];
+  delete[] none;
+
+  /* Objects deleted on another thread go back to their owner's heap */
+  std::vector<std::unique_ptr<std::string>> strings;
+  for (int i = 0; i < 1000; i++)
+    strings.push_back(std::make_unique<std::string>(50, 'y'));
+  std::thread([&strings] { strings.clear(); }).join();
+
+  /* Sized deletes in a destructor running after the thread's heap was
+   * abandoned */
+  pthread_key_create(&late_key, late_destructor);
+  std::thread([] {
+    delete new int(0);
+    pthread_setspecific(late_key, &late_key);
+  }).join();
+  pthread_key_delete(late_key);
+  printf("sized delete without a heap %s\n", late_deleted ? "done" : "failed");
+  printf("global operator new test complete\n");
+}
+
+int main() {
+  test_stl_allocator();
+  test_pool_allocator();
+  test_memory_resources();
+  test_global_new();
+
+  return 0;
+}